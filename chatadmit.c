@@ -0,0 +1,110 @@
+// chatadmit.c - admission control of the new connections
+#include "chatadmit.h"
+#include "chatcapture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+admission_config_t admission_config = {
+    .max_connections = 0,
+    .max_per_ip = 0,
+    .max_unjoined = 0,
+};
+
+static const char* shed_names[SHED_REASONS] = {
+    "too many connections",
+    "too many connections from your address",
+    "too many connections waiting to join",
+    "out of file descriptors",
+};
+
+static unsigned long shed_count[SHED_REASONS];
+static time_t last_report = 0;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static int spare_fd = -1;
+
+int admission_init(void)
+{
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (spare_fd < 0) ? -1 : 0;
+}
+
+void admission_peer(int fd, peer_addr_t* peer)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    memset(peer, 0, sizeof(*peer));
+    if (getpeername(fd, (struct sockaddr*)&addr, &len) < 0) return;
+
+    if (addr.ss_family == AF_INET) {
+        peer->family = AF_INET;
+        memcpy(peer->addr, &((struct sockaddr_in*)&addr)->sin_addr, 4);
+    } else if (addr.ss_family == AF_INET6) {
+        peer->family = AF_INET6;
+        memcpy(peer->addr, &((struct sockaddr_in6*)&addr)->sin6_addr, 16);
+    }
+}
+
+bool admission_same_peer(const peer_addr_t* a, const peer_addr_t* b)
+{
+    return (a->family != 0) && (a->family == b->family)
+        && (0 == memcmp(a->addr, b->addr, sizeof(a->addr)));
+}
+
+// count a shed connection, called with admission_lock held
+static void count_shed(shed_reason_t reason)
+{
+    shed_count[reason]++;
+    time_t now = time(NULL);
+    if (now != last_report) {
+        last_report = now;
+        fprintf(stdout, "shed connections: %lu full, %lu per ip, %lu unjoined, %lu no fds\n",
+                shed_count[SHED_FULL], shed_count[SHED_PER_IP],
+                shed_count[SHED_UNJOINED], shed_count[SHED_NO_FDS]);
+        fflush(stdout);
+    }
+}
+
+static void send_busy(int fd, shed_reason_t reason)
+{
+    char reply[128];
+    int len = snprintf(reply, sizeof(reply), BUSY_MESSAGE "%s\n", shed_names[reason]);
+
+    // never wait for a client we are refusing
+    send(fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void admission_shed(int fd, shed_reason_t reason)
+{
+    send_busy(fd, reason);
+
+    pthread_mutex_lock(&admission_lock);
+    count_shed(reason);
+    pthread_mutex_unlock(&admission_lock);
+}
+
+int admission_accept_spare(int listenfd, bool local)
+{
+    int rv = -1;
+
+    pthread_mutex_lock(&admission_lock);
+    if (spare_fd >= 0) {
+        close(spare_fd);
+
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd >= 0) {
+            uint32_t capture = capture_connect(local, true);
+            send_busy(fd, SHED_NO_FDS);
+            close(fd);
+            capture_close(capture);
+            count_shed(SHED_NO_FDS);
+            rv = 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            rv = 0; // taken by someone else
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pthread_mutex_unlock(&admission_lock);
+    return rv;
+}
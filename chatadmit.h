@@ -0,0 +1,68 @@
+// chatadmit.h - admission control of the new connections
+//
+// A connection over the limits (all the connections, the connections of
+// one IP address, or the connections that did not JOIN yet) gets a short
+// "Server busy" line and is closed right away, instead of waiting for a
+// slot that will not come. When the process runs out of descriptors,
+// accept() fails and the connection would stay in the backlog, waking
+// up the accept loop again and again: a spare descriptor is kept to
+// accept it and shed it the same way.
+// The shed connections are counted by reason, and the counters printed
+// at most once per second.
+
+#ifndef __CHAT_ADMIT
+#define __CHAT_ADMIT
+
+#include "nethelp.h"
+#include <stdbool.h>
+
+#define ADMISSION_BACKOFF_MS (10) // pause of accept without spare descriptor
+#define BUSY_MESSAGE "Server busy, try again later: "
+
+typedef enum {
+    SHED_FULL = 0,  // max connections
+    SHED_PER_IP,    // max connections of the IP address
+    SHED_UNJOINED,  // max connections that did not JOIN
+    SHED_NO_FDS,    // out of file descriptors
+    SHED_REASONS
+} shed_reason_t;
+
+// limits, 0 for no limit
+typedef struct {
+    int max_connections;
+    int max_per_ip;
+    int max_unjoined;
+} admission_config_t;
+
+extern admission_config_t admission_config;
+
+// address of a peer, to count the connections per IP
+typedef struct {
+    int family;     // AF_INET, AF_INET6, 0 if unknown (local clients)
+    unsigned char addr[16];
+} peer_addr_t;
+
+/*
+ * admission_init - reserve the spare descriptor
+ * return -1 in case of failure
+ */
+int admission_init(void);
+
+// get the IP address of the peer of socket fd
+void admission_peer(int fd, peer_addr_t* peer);
+
+// true if both are the same known IP address
+bool admission_same_peer(const peer_addr_t* a, const peer_addr_t* b);
+
+// send the busy reply to fd and count it, the caller closes fd
+void admission_shed(int fd, shed_reason_t reason);
+
+/*
+ * admission_accept_spare - accept() failed with EMFILE or ENFILE: free
+ * the spare descriptor to accept a pending connection and shed it.
+ * local tells if listenfd is the unix domain socket, for the capture
+ * return -1 if it was not possible, the caller should back off
+ */
+int admission_accept_spare(int listenfd, bool local);
+
+#endif //__CHAT_ADMIT
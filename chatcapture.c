@@ -0,0 +1,242 @@
+// chatcapture.c - capture of the traffic received by the server
+#include "chatcapture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// two buffers: the recorders fill the active one while the other is
+// written to the file
+static char* buffers[2];
+static size_t used[2];
+static bool full[2];    // waiting to be written
+static int active = 0;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushed_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;   // write everything and stop
+static bool stopped = false;    // all written, nothing more is recorded
+static int capture_fd = -1;
+static struct timespec start;
+static uint32_t next_conn = 0;
+static unsigned long dropped = 0;
+
+static uint64_t since_start(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * CaptureWriter - thread function that writes the full buffers to the
+ * file, and the active one when it waited for a second, or at once when
+ * stopping
+ */
+static void* CaptureWriter(void* arg)
+{
+    unsigned long reported = 0;
+    bool failed = false;
+
+    (void)arg;
+    pthread_mutex_lock(&capture_lock);
+    while (!stopped) {
+        // only the buffer that is not active can be full
+        if (!full[1 - active] && !stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&capture_cond, &capture_lock, &deadline);
+        }
+        if (!full[1 - active] && used[active] > 0) {
+            full[active] = true;
+            active = 1 - active;
+        }
+
+        int b = 1 - active;
+        if (full[b]) {
+            pthread_mutex_unlock(&capture_lock);
+            if (!failed && write_all(capture_fd, buffers[b], used[b]) < 0) {
+                fprintf(stderr, "capture: write failed, nothing more is recorded\n");
+                failed = true;
+            }
+            pthread_mutex_lock(&capture_lock);
+            used[b] = 0;
+            full[b] = false;
+        } else if (stopping) {
+            stopped = true; // both buffers are empty
+            pthread_cond_broadcast(&flushed_cond);
+        }
+
+        if (dropped != reported) {
+            reported = dropped;
+            fprintf(stdout, "capture: %lu records dropped\n", dropped);
+            fflush(stdout);
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return NULL;
+}
+
+/*
+ * CaptureStopper - thread function that writes the records still in
+ * memory when the process gets SIGINT or SIGTERM, then lets the signal
+ * end it
+ */
+static void* CaptureStopper(void* arg)
+{
+    sigset_t* signals = (sigset_t*)arg;
+    int signal_number;
+
+    while (sigwait(signals, &signal_number) != 0) {}
+    capture_flush();
+
+    signal(signal_number, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, signals, NULL);
+    raise(signal_number);
+    return NULL;
+}
+
+int capture_open(const char* path)
+{
+    static sigset_t signals;
+    capture_header_t header;
+    pthread_t tid;
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture_fd < 0) return -1;
+
+    buffers[0] = malloc(CAPTURE_BUFFER);
+    buffers[1] = malloc(CAPTURE_BUFFER);
+    if (buffers[0] == NULL || buffers[1] == NULL) goto fail;
+
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.start_sec = realtime.tv_sec;
+    header.start_nsec = realtime.tv_nsec;
+    if (write_all(capture_fd, (const char*)&header, sizeof(header)) < 0) goto fail;
+
+    // the threads of the capture take no signal, but the ones the
+    // stopper waits for. Then they are blocked in this thread, and so in
+    // all the threads created after it
+    sigset_t all, saved;
+    sigfillset(&all);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &all, &saved) != 0) goto fail;
+    bool started = (pthread_create(&tid, NULL, CaptureWriter, NULL) == 0);
+    if (started) { pthread_detach(tid); }
+    started = started && (pthread_create(&tid, NULL, CaptureStopper, &signals) == 0);
+    if (started) { pthread_detach(tid); }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (!started) goto fail;
+
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    return 0;
+
+fail:
+    free(buffers[0]);
+    free(buffers[1]);
+    close(capture_fd);
+    capture_fd = -1;
+    return -1;
+}
+
+bool capture_enabled(void)
+{
+    return capture_fd >= 0;
+}
+
+void capture_flush(void)
+{
+    if (capture_fd < 0) return;
+
+    pthread_mutex_lock(&capture_lock);
+    stopping = true;
+    pthread_cond_signal(&capture_cond);
+    while (!stopped) {
+        pthread_cond_wait(&flushed_cond, &capture_lock);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static void record(capture_kind_t kind, uint32_t conn, const char* data, size_t len)
+{
+    if (len > UINT16_MAX) { len = UINT16_MAX; }
+    size_t size = sizeof(capture_record_t) + len;
+
+    pthread_mutex_lock(&capture_lock);
+    if (stopping) {
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    if (used[active] + size > CAPTURE_BUFFER) {
+        if (full[1 - active]) {
+            dropped++; // the writer is behind, never wait for it
+            pthread_mutex_unlock(&capture_lock);
+            return;
+        }
+        full[active] = true;
+        active = 1 - active;
+        pthread_cond_signal(&capture_cond);
+    }
+
+    // the time is taken under the lock, so the records are in order
+    capture_record_t header = {
+        .ns = since_start(),
+        .conn = conn,
+        .len = len,
+        .kind = kind,
+    };
+    char* out = buffers[active] + used[active];
+    memcpy(out, &header, sizeof(header));
+    if (len > 0) { memcpy(out + sizeof(header), data, len); }
+    used[active] += size;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+uint32_t capture_connect(bool local, bool refused)
+{
+    if (capture_fd < 0) return 0;
+
+    char flag = (local ? CAPTURE_LOCAL : 0) | (refused ? CAPTURE_REFUSED : 0);
+    uint32_t conn = __atomic_add_fetch(&next_conn, 1, __ATOMIC_RELAXED);
+    record(CAPTURE_OPEN, conn, &flag, 1);
+    return conn;
+}
+
+void capture_line(uint32_t conn, const char* line, size_t len)
+{
+    if (conn == 0) return;
+    record(CAPTURE_LINE, conn, line, len);
+}
+
+void capture_close(uint32_t conn)
+{
+    if (conn == 0) return;
+    record(CAPTURE_CLOSE, conn, NULL, 0);
+}
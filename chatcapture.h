@@ -0,0 +1,80 @@
+// chatcapture.h - capture of the traffic received by the server
+//
+// With a capture file, the server records what its clients send: when
+// a connection opens, every line it sends, and when it closes. chatreplay
+// plays a capture against a server, with the same connections and timing,
+// to reproduce a shape of traffic (a reconnect storm, a flood, a busy
+// room) and compare builds.
+//
+// The file is a header followed by records, in the byte order of the
+// host:
+//
+//     capture_header_t
+//     capture_record_t, followed by 'len' bytes of data (lines only)
+//     ...
+//
+// The records are in order of time. Recording only copies the record
+// into a buffer in memory; a thread of its own writes the full buffers
+// to the file, and the rest at least once per second. When it can not
+// keep up, the records are dropped, and counted, instead of slowing the
+// clients down. On SIGINT or SIGTERM the records still in memory are
+// written before the process ends; a crash, or SIGKILL, loses up to the
+// last second of them.
+
+#ifndef __CHAT_CAPTURE
+#define __CHAT_CAPTURE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_BUFFER (1024 * 1024) // bytes of records kept in memory, twice
+
+typedef enum {
+    CAPTURE_OPEN = 0,   // a client connected, len 1: its CAPTURE_ flags
+    CAPTURE_LINE,       // a line of the client, with its '\n'
+    CAPTURE_CLOSE       // the connection was closed (or became a link)
+} capture_kind_t;
+
+// flags of CAPTURE_OPEN
+#define CAPTURE_LOCAL (1)   // on the unix domain socket
+#define CAPTURE_REFUSED (2) // shed by the admission control, its CLOSE follows
+
+typedef struct {
+    char magic[8];          // CAPTURE_MAGIC
+    int64_t start_sec;      // CLOCK_REALTIME of the start of the capture
+    int64_t start_nsec;
+} capture_header_t;
+
+typedef struct {
+    uint64_t ns;            // since the start of the capture
+    uint32_t conn;          // connection, numbered from 1 in order of arrival
+    uint16_t len;           // bytes of data after the record
+    uint8_t kind;           // capture_kind_t
+    uint8_t reserved;
+} capture_record_t;
+
+/*
+ * capture_open - start recording into the file path. SIGINT and SIGTERM
+ * are blocked in the calling thread, call it before creating the others
+ * return -1 in case of failure
+ */
+int capture_open(const char* path);
+
+// true if recording
+bool capture_enabled(void);
+
+// write the records still in memory and stop recording
+void capture_flush(void);
+
+// a new connection, or one refused, return its number, 0 if not recording
+uint32_t capture_connect(bool local, bool refused);
+
+// a line of len bytes from connection conn
+void capture_line(uint32_t conn, const char* line, size_t len);
+
+// connection conn was closed
+void capture_close(uint32_t conn);
+
+#endif //__CHAT_CAPTURE
@@ -42,77 +42,120 @@
  */
 
 #include "nethelp.h"
+#include "chattransport.h"
+#include "chatzip.h"
 #include <stdlib.h>
-#include <pthread.h>
 #include <string.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <errno.h>
 
 #define MAX_MESSAGE_SIZE (512)
 #define VERSION "Chat Client v0.1"
 
+// the client is a single thread: one event loop waits with poll() for
+// the user input and the messages of the server, so no thread is blocked
+// in fgets() or recv() and there is no thread to clean up at the end.
+// POLL_LINK is the socket of a shared memory channel, to see when it closes
+enum { POLL_STDIN = 0, POLL_SERVER, POLL_LINK, POLL_FDS };
+
 // function prototypes
-void* HandleFeedback(int fd);
-size_t readInput(char* buf, int buf_size);
-void* ReadMessagesFromServerLoop(void* fileDescriptor);
-void readTextAndSendToServerLoop(int clientfd);
+int ChatLoop(transport_t* server);
+int HandleServerInput(transport_t* server, linebuf_t* input);
+int HandleUserInput(transport_t* server, linebuf_t* input);
+void printUsage(const char* program);
 void printCommands(void);
 void printWelcomeMessage(void);
 void printVERSION(void);
+void CheckCompressAnswer(const char* message);
 
-typedef struct {
-  // thread parameters to pass in
-  int fileDescriptor;
-} threadParams_t;
-
-// global variables
-pthread_t thread_id;		// this thread will be used to handle the responses from the server
-threadParams_t parameter;	// this parameter will be used to pass parameters to the previous thread.
+// the records of chatzip.h are only read after the server acknowledged
+// a COMPRESS request: before, a line starting with ZIP_MARKER is text
+static int compress_asked = 0;  // COMPRESS requests not answered yet
+static bool decompressing = false;
 
 int main(int argc, char* argv[])
 {
-    int clientfd, port, tid;
-    char* host, buff[MAXLINE];
-
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
-        // argv[0] is the name of the program by convention
-        exit(EXIT_FAILURE);
+    int clientfd, port;
+    char* host;
+    char* unix_path = NULL; // server on the same host, unix domain socket
+    bool shared_memory = false;
+    const char* compression = NULL; // class asked to the server, see chatzip.h
+    transport_t server;
+
+    int option;
+    while ((option = getopt(argc, argv, "u:m:z:")) != -1) {
+        if (option == 'z' && zip_class_parse(optarg) >= 0) {
+            compression = optarg;
+        } else if (option == 'u' || option == 'm') {
+            unix_path = optarg;
+            shared_memory = (option == 'm');
+        } else {
+            printUsage(argv[0]);
+        }
     }
 
-   // get the name of the machine on which the server is running
-   host = argv[1];
-
-   // get the port number on which server is listening for the client requests
-   port = atoi(argv[2]);
-   // atoi is not the best option, as it doesn't report errors
-   // it would be better to use strol function
-   // ref: http://www.microhowto.info/howto/safely_parse_an_integer_using_the_standard_c_library.html
+    if ((unix_path == NULL && argc - optind != 2) || (unix_path != NULL && argc != optind)) {
+        printUsage(argv[0]);
+    }
 
    printWelcomeMessage();
 
-   // open a connection to the server
-   clientfd = open_clientfd(host, port);
-   if (clientfd < 0) {
-       printf("Connection to <%s, %d> failed\n", host, port);
-       exit(EXIT_FAILURE);
+   if (shared_memory) {
+       if (transport_connect_shm(&server, unix_path) < 0) {
+           printf("Shared memory connection to <%s> failed\n", unix_path);
+           exit(EXIT_FAILURE);
+       }
    } else {
-       printf("Connection to the server opened...\n");
+       if (unix_path != NULL) {
+           clientfd = open_unix_clientfd(unix_path);
+       } else {
+           // get the name of the machine on which the server is running
+           host = argv[optind];
+
+           // get the port number on which server is listening for the client requests
+           port = atoi(argv[optind + 1]);
+           // atoi is not the best option, as it doesn't report errors
+           // it would be better to use strol function
+           // ref: http://www.microhowto.info/howto/safely_parse_an_integer_using_the_standard_c_library.html
+
+           // open a connection to the server
+           clientfd = open_clientfd(host, port);
+       }
+       if (clientfd < 0) {
+           printf("Connection to the server failed\n");
+           exit(EXIT_FAILURE);
+       }
+       transport_init_socket(&server, clientfd);
+   }
+   printf("Connection to the server opened...\n");
+
+   if (compression != NULL) {
+       char request[MAX_MESSAGE_SIZE];
+       int len = snprintf(request, sizeof(request), "COMPRESS %s\n", compression);
+       if (transport_write(&server, request, len) < 0) {
+           printf("Error sending the compression request\n");
+       } else {
+           compress_asked++;
+       }
    }
 
-   // TODO: create a thread to read messages from the server
-   // and print them on the screen
-
-   HandleFeedback(clientfd);
-
-   // TODO: In a loop, read string from user and send them to
-   // the server & terminate when the user writes LEAVE
-
-   readTextAndSendToServerLoop(clientfd);
+   // read lines from the user and send them to the server, and print
+   // the messages from the server, until LEAVE or the end of any of them
+   int rv = ChatLoop(&server);
 
    // close sockets
-   close(clientfd);
-   return(EXIT_SUCCESS);
+   transport_release(&server);
+   close(server.fd);
+   return (rv < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void printUsage(const char* program) {
+    fprintf(stderr, "usage: %s [-z none|plain|chat] <host> <port>\n"
+                    "       %s [-z none|plain|chat] -u <unix_socket_path>   (server on this host)\n"
+                    "       %s [-z none|plain|chat] -m <unix_socket_path>   (server on this host, shared memory)\n",
+                    program, program, program);
+    // argv[0] is the name of the program by convention
+    exit(EXIT_FAILURE);
 }
 
 void printCommands(void) {
@@ -133,141 +176,132 @@ void printVERSION(void) {
     printf("%s\n", VERSION);
 }
 
-void *ReadMessagesFromServerLoop(void* parameter) {
-
-   // retrieve the socket file descriptor passed as a paremeter of the thread.
-   threadParams_t *param = (threadParams_t*)parameter;
-   int fileDescriptor = param->fileDescriptor;
-
-   // Detach the thread to free memory resources upon termination
-   pthread_detach(pthread_self());
-
-   // reference: https://man7.org/linux/man-pages/man2/read.2.html
-   // reference: https://man7.org/linux/man-pages/man2/recv.2.html
-   // The only difference between recv() and read(2) is the presence of
-   // flags. With a zero flags argument, recv() is generally
-   // equivalent to read(2) (but see NOTES)
-
-   char message[MAX_MESSAGE_SIZE];
-
-   while(1) {
-       memset(message,0x00,sizeof(char)*MAX_MESSAGE_SIZE);
-       ssize_t readedBytes = 0;
-       readedBytes = recv(fileDescriptor, message, (MAX_MESSAGE_SIZE-1), 0);
-       message[MAX_MESSAGE_SIZE -1] = '\0'; // just in case to protect the message size
-       printf("%s\n", message);
-   }
+/*
+ * ChatLoop - event loop of the client
+ * return 0 when the chat is finished (LEAVE, end of the user input
+ * or the server closed the connection), -1 in case of failure
+ */
+int ChatLoop(transport_t* server)
+{
+    // reference: https://man7.org/linux/man-pages/man2/poll.2.html
+    struct pollfd fds[POLL_FDS];
+    linebuf_t user_input, server_input;
+    int rv = 1;
+
+    linebuf_init(&user_input);
+    linebuf_init(&server_input);
+
+    fds[POLL_STDIN].fd = STDIN_FILENO;
+    fds[POLL_STDIN].events = POLLIN;
+    fds[POLL_SERVER].fd = transport_pollfd(server);
+    fds[POLL_SERVER].events = POLLIN;
+    fds[POLL_LINK].fd = (server->shm != NULL) ? server->fd : -1; // ignored by poll() if -1
+    fds[POLL_LINK].events = POLLIN;
+
+    while (rv > 0) {
+        // with shared memory, there may be messages waiting already
+        bool pending = transport_prepare_poll(server);
+
+        if (poll(fds, POLL_FDS, pending ? 0 : -1) < 0) {
+            if (errno == EINTR) { continue; }
+            reportErrno();
+            return -1;
+        }
+
+        // the messages of the server first, they may explain why it closes
+        if (pending || (fds[POLL_SERVER].revents & (POLLIN | POLLHUP | POLLERR))
+            || (fds[POLL_LINK].revents != 0)) {
+            rv = HandleServerInput(server, &server_input);
+        }
+        if ((rv > 0) && (fds[POLL_STDIN].revents & (POLLIN | POLLHUP | POLLERR))) {
+            rv = HandleUserInput(server, &user_input);
+        }
+    }
+    return rv;
 }
 
-// Thread function that reads messages from server and
-// writes them onto the screen
-void* HandleFeedback(int fileDescriptor)
+/*
+ * HandleServerInput - read the messages from the server and print them
+ * onto the screen. A message split in several TCP segments is printed
+ * only once it is complete, and a compressed one once decompressed.
+ * return 1 to continue, 0 if the server closed the connection, -1 on failure
+ */
+int HandleServerInput(transport_t* server, linebuf_t* input)
 {
-    // Since the chat client and the chat server operate asynchronously
-    // (the server can send messages to the client at any time), the
-    // client needs to spawn a thread to handle messages received.
-    // from the server.
-    //
-    // Implement the HandleFeedback tread function that reads messages
-    // from the server and prints them onto the screen. The function
-    // loops indefinitely, until EOF (end-of-file) is received (in
-    // response of the server closing the connection to the client
-    // for whatever reason).
-    //
-    // exit when the connection is terminated
-
-    // TODO: add code here
-
-    if (fileDescriptor == NULL) {
-	printf("Error fileDescriptor for the server is NULL!!\n");
-	exit(EXIT_FAILURE);
+    char message[MAXLINE];
+
+    ssize_t n = transport_fill(server, input, true);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN) { return 1; }
+        printf("Error reading from the server\n");
+        reportErrno();
+        return -1;
     }
 
-    parameter.fileDescriptor = fileDescriptor;
-
-    // create thread
-    int rv =     \
-    pthread_create(&thread_id,			// pointer to thread descriptor
-		   (void*)0,			// use default attributes
-		   ReadMessagesFromServerLoop,	// thread function entry point
-		   (void*)&parameter		// parameters to pass in
-                  );
-
-    if (rv != 0) {
-	printf("Error creating thread: %d\n", rv);
-	exit(EXIT_FAILURE);
+    int len;
+    while ((len = decompressing ? zip_getmessage(input, message, sizeof(message))
+                                : linebuf_getline(input, message, sizeof(message))) > 0) {
+        fputs(message, stdout);
+        if (compress_asked > 0) { CheckCompressAnswer(message); }
+    }
+    fflush(stdout);
+    if (len < 0) {
+        printf("Corrupt compressed message from the server\n");
+        return -1;
     }
 
-    // this thread must be terminated when the command LEAVE is used!
+    if (n == 0) {
+        printf("Connection closed by the server\n");
+        return 0;
+    }
+    return 1;
 }
 
-size_t readInput(char* buf, int buf_size) {
-    // never use `gets()`! instead use: `fgets()`.
-    /*
-    gets() is dangerous because it is possible for the user to crash
-    the program by typing too much into the prompt. It can't detect the
-    end of available memory, so if you allocate an amount of memory
-    too small for the purpose, it can cause a seg fault and crash.
-    ... so we use fgets() because allows you to specify how many characters
-    are taken out of the standard input buffer, so they don't overrun the variable.
-    */
-
-    // use this: `fgets()`: "file get string", which reads until either EOF is
-    // reached, OR a newline (`\n`) is found, keeping the newline char in
-    // `buf`.
-    // For `feof()` and `ferror()`, see:
-    // 1. https://en.cppreference.com/w/c/io/feof
-    // 1. https://en.cppreference.com/w/c/io/ferror
-
-    errno = 0;
-    char* retval = fgets(buf, buf_size, stdin);
-    /* fgets() reads in at most one less than size characters from stream and
-     * stores them into the buffer pointed to by s.  Reading stops after an EOF
-     * or a newline.  If a newline is read, it is stored into the buffer. A
-     * terminating null byte ('\0') is stored after the last character in the buffer. */
-
-    if (feof(stdin))
-    {
-	// Check for `EOF`, which means "End of File was reached".
-	// - This doesn't really make sense on `stdin`, but it is a good
-	//   check to have when reading from a regular file with `fgets
-	//   ()`. Keep it here regardless, just in case.
-	perror("EOF (End of File) reached.\n");
-    }
-    if (ferror(stdin))
-    {
-	perror("Error indicator set. IO error when reading from file "
-	       "`stdin`.\n");
+/*
+ * CheckCompressAnswer - start or stop reading records when the message
+ * is the answer of the server to COMPRESS. No other message of the
+ * server can look like it: the lines that start with a name (WHO, the
+ * notices) can not, the server takes names of 20 characters at most
+ */
+void CheckCompressAnswer(const char* message)
+{
+    char name[16];
+    size_t threshold;
+    int end = 0;
+
+    if (0 == strcmp(message, "usage: COMPRESS none|plain|chat\n")) {
+        compress_asked--;
+        return;
     }
-    if (retval == NULL)
-    {
-	fprintf(stderr, "ERROR in %s(): fgets() failed; errno = %i: %s\n",
-	    __func__, errno, strerror(errno));
-	exit(EXIT_FAILURE);
-    } else if (retval == buf) {
-	size_t num_chars_written = strlen(buf) + 1; // + 1 for null terminator
-	// TODO: do I have to check if we got a newline character??
-	if (num_chars_written >= buf_size)
-	{
-	    printf("Warning: user input may have been truncated! All %zu chars "
-	      "were written into buffer.\n", num_chars_written);
-	}
-	return strlen(buf);
+    if ((2 == sscanf(message, "Compression: %15[a-z], messages of %zu bytes or more%n", name, &threshold, &end))
+        && (0 == strcmp(message + end, "\n")) && (zip_class_parse(name) >= 0)) {
+        compress_asked--;
+        decompressing = (zip_class_parse(name) != ZIP_NONE);
     }
-
-    return -1;
 }
 
-void readTextAndSendToServerLoop(int clientfd) {
+/*
+ * HandleUserInput - read the lines typed by the user and send
+ * them to the server, LEAVE finishes the chat
+ * return 1 to continue, 0 when the chat is finished, -1 on failure
+ */
+int HandleUserInput(transport_t* server, linebuf_t* input)
+{
     char message[MAX_MESSAGE_SIZE];
-    size_t message_length = 0;
+    int message_length;
 
-    //memset(message,0x00,sizeof(char)*MAX_MESSAGE_SIZE);
+    ssize_t n = linebuf_fill(input, STDIN_FILENO);
+    if (n < 0) {
+        if (errno == EINTR) { return 1; }
+        reportErrno();
+        return -1;
+    }
 
-    // get string from the user
-    message_length = readInput(message, MAX_MESSAGE_SIZE);
+    while ((message_length = linebuf_getline(input, message, sizeof(message))) > 0) {
 
-    while(strncmp(message, "LEAVE", strlen("LEAVE"))) { // check if the LEAVE command has been used
+       if (!strncmp(message, "LEAVE", strlen("LEAVE"))) { // check if the LEAVE command has been used
+           break;
+       }
 
        if (!strncmp(message, "VERSION", strlen("VERSION"))) {
            printVERSION();
@@ -277,21 +311,23 @@ void readTextAndSendToServerLoop(int clientfd) {
            printCommands();
        }
 
-       // send string to the server
-       send(clientfd, message, message_length, 0);
-
-       //memset(message,0x00,sizeof(char)*MAX_MESSAGE_SIZE);
+       if (!strncmp(message, "COMPRESS ", strlen("COMPRESS "))) {
+           compress_asked++;
+       }
 
-       // get string from the user
-       message_length = readInput(message, MAX_MESSAGE_SIZE-1);
-       message[message_length+1] = '\0'; // end of string
+       // send string to the server
+       if (transport_write(server, message, message_length) < 0) {
+           printf("Error sending the message to the server\n");
+           reportErrno();
+           return -1;
+       }
        printf("\n");
     }
 
-    // TODO send LEAVE command  message to server
-    send(clientfd, "LEAVE\n", strlen("LEAVE\n"), 0);
-
-    // TODO kill the reading server thread!
-    // the thead is detached, so it will delete itself when finishing the program.
+    // LEAVE, or the end of the user input (ex: ctrl-D, or a closed pipe)
+    if ((message_length > 0) || (n == 0)) {
+        transport_write(server, "LEAVE\n", strlen("LEAVE\n"));
+        return 0;
+    }
+    return 1;
 }
-
@@ -0,0 +1,233 @@
+// chatfanout.c - parallel fan-out with a pool of work-stealing workers
+#include "chatfanout.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEQUE_CAPACITY (64) // initial chunks per deque, it grows if needed
+
+fanout_config_t fanout_config = {
+    .workers = 0,
+    .threshold = DEFAULT_FANOUT_THRESHOLD,
+    .chunk = DEFAULT_FANOUT_CHUNK,
+};
+
+// one call to fanout_run(), waiting for its chunks
+typedef struct {
+    fanout_fn_t fn;
+    void* arg;
+    int pending;            // chunks not delivered yet, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} fanout_job_t;
+
+typedef struct {
+    fanout_job_t* job;
+    int first;
+    int last;
+} fanout_task_t;
+
+// chunks of a worker: the owner takes from the tail, thieves from the head
+typedef struct {
+    pthread_mutex_t lock;
+    fanout_task_t* tasks;   // ring of capacity entries
+    int capacity;
+    int head;
+    int count;
+} fanout_deque_t;
+
+static fanout_deque_t deques[MAX_FANOUT_WORKERS];
+static int worker_count = 0;
+
+// idle workers sleep until there are chunks queued
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static int queued = 0;      // chunks in all the deques
+
+// add a chunk at the tail, return -1 if there is no memory
+static int deque_push(fanout_deque_t* deque, fanout_task_t task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity * 2;
+        fanout_task_t* tasks = malloc(capacity * sizeof(fanout_task_t));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (int i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// take a chunk, from the tail for the owner or from the head for a thief
+static bool deque_take(fanout_deque_t* deque, bool owner, fanout_task_t* task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (owner) {
+            *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+        } else {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        deque->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (found) {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+/*
+ * take_task - a chunk from the deque of worker 'self' or, when it is
+ * empty, stolen from the other ones. self is -1 for the callers of
+ * fanout_run(), that have no deque.
+ */
+static bool take_task(int self, fanout_task_t* task)
+{
+    if (self >= 0 && deque_take(&deques[self], true, task)) {
+        return true;
+    }
+    for (int i = 1; i <= worker_count; i++) {
+        int victim = (self + i) % worker_count;
+        if (victim != self && deque_take(&deques[victim], false, task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_task(fanout_task_t* task)
+{
+    fanout_job_t* job = task->job;
+
+    job->fn(task->first, task->last, job->arg);
+
+    // the job lives in the stack of its caller: do not touch it after
+    // the last chunk is counted, except to wake up the caller
+    pthread_mutex_lock(&job->lock);
+    if (--job->pending == 0) {
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void* FanoutWorker(void* arg)
+{
+    int self = (int)(long)arg;
+    fanout_task_t task;
+
+    while (1) {
+        if (take_task(self, &task)) {
+            run_task(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        while (__atomic_load_n(&queued, __ATOMIC_RELAXED) <= 0) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+int fanout_init(void)
+{
+    if (fanout_config.chunk < 1) {
+        fanout_config.chunk = DEFAULT_FANOUT_CHUNK;
+    }
+    if (fanout_config.workers > MAX_FANOUT_WORKERS) {
+        fanout_config.workers = MAX_FANOUT_WORKERS;
+    }
+
+    for (int i = 0; i < fanout_config.workers; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].tasks = malloc(DEQUE_CAPACITY * sizeof(fanout_task_t));
+        if (deques[i].tasks == NULL) {
+            return -1;
+        }
+        deques[i].capacity = DEQUE_CAPACITY;
+        deques[i].head = 0;
+        deques[i].count = 0;
+    }
+
+    for (int i = 0; i < fanout_config.workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, FanoutWorker, (void*)(long)i) != 0) {
+            fprintf(stderr, "failed to create the fan-out worker %d\n", i);
+            break;
+        }
+        pthread_detach(tid);
+        worker_count++;
+    }
+    return (worker_count == fanout_config.workers) ? 0 : -1;
+}
+
+void fanout_run(int count, int recipients, fanout_fn_t fn, void* arg)
+{
+    int chunk = fanout_config.chunk;
+
+    if (worker_count == 0 || recipients < fanout_config.threshold || count <= chunk) {
+        fn(0, count, arg);
+        return;
+    }
+
+    fanout_job_t job = { .fn = fn, .arg = arg, .pending = 0 };
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    // count the chunks first: a fast worker must not see pending reach 0
+    // before all of them are queued
+    job.pending = (count + chunk - 1) / chunk;
+
+    // spread the chunks over the deques, round robin
+    int pushed = 0;
+    for (int first = 0, w = 0; first < count; first += chunk, w = (w + 1) % worker_count) {
+        fanout_task_t task = { &job, first, (first + chunk < count) ? first + chunk : count };
+        if (deque_push(&deques[w], task) < 0) {
+            run_task(&task); // no memory to queue it: deliver it here
+            continue;
+        }
+        pushed++;
+    }
+
+    if (pushed > 0) {
+        __atomic_add_fetch(&queued, pushed, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_broadcast(&pool_work);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    // help with the chunks while they last, then wait for the workers
+    fanout_task_t task;
+    while (take_task(-1, &task)) {
+        run_task(&task);
+    }
+
+    pthread_mutex_lock(&job.lock);
+    while (job.pending > 0) {
+        pthread_cond_wait(&job.done, &job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_cond_destroy(&job.done);
+    pthread_mutex_destroy(&job.lock);
+}
@@ -0,0 +1,48 @@
+// chatfanout.h - parallel fan-out of broadcasts to very large rooms
+//
+// Delivering a broadcast means queueing the frame for every recipient.
+// For a few recipients that is done inline, on the thread of the sender.
+// Above a threshold, the recipients (slots of the array of clients) are
+// split in chunks that a pool of workers delivers in parallel. Every
+// worker has its own deque of chunks, and a worker without work steals
+// chunks from the others, so a slow chunk does not leave cores idle.
+//
+// fanout_run() returns only when all the chunks are delivered (the
+// caller helps meanwhile), so the broadcasts of a sender never overtake
+// each other, and the caller can keep holding the locks it needs for
+// the whole delivery: every recipient gets the messages in the same
+// order as with the inline path.
+
+#ifndef __CHAT_FANOUT
+#define __CHAT_FANOUT
+
+#define DEFAULT_FANOUT_THRESHOLD (512)  // recipients to use the workers
+#define DEFAULT_FANOUT_CHUNK (128)      // slots per chunk
+#define MAX_FANOUT_WORKERS (64)
+
+// delivers the items in [first, last)
+typedef void (*fanout_fn_t)(int first, int last, void* arg);
+
+// settings of the fan-out, set before fanout_init()
+typedef struct {
+    int workers;    // threads of the pool, 0 delivers always inline
+    int threshold;  // recipients from which the pool is used
+    int chunk;      // items per chunk
+} fanout_config_t;
+
+extern fanout_config_t fanout_config;
+
+/*
+ * fanout_init - start the pool of workers
+ * return -1 in case of failure
+ */
+int fanout_init(void);
+
+/*
+ * fanout_run - call fn for all the items in [0, count), in chunks
+ * spread over the workers when 'recipients' reaches the threshold,
+ * inline otherwise. return when all of them are done.
+ */
+void fanout_run(int count, int recipients, fanout_fn_t fn, void* arg);
+
+#endif //__CHAT_FANOUT
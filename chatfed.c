@@ -0,0 +1,572 @@
+// chatfed.c - relay of the chat events between federated servers
+#include "chatfed.h"
+#include "nethelp.h"
+#include <errno.h>
+#include <sys/time.h>
+
+typedef struct {
+    bool used;
+    int fd;
+    unsigned int node;    // node id of the other end
+    outqueue_t* queue;    // frames to the other end
+    bool cut;             // shut down, it could not take more lines
+} fed_link_t;
+
+typedef struct {
+    char* name;
+    unsigned int origin;  // node where the client is connected
+    unsigned int via;     // node of the link where we learned it
+} remote_user_t;
+
+typedef struct {
+    char host[MAXLINE];
+    int port;
+} peer_t;
+
+unsigned int fed_node_id = 0;
+
+static fed_hooks_t hooks;
+static pthread_mutex_t fed_lock = PTHREAD_MUTEX_INITIALIZER; // links, remote_users, windows
+static fed_link_t links[MAX_PEERS];
+static remote_user_t remote_users[MAX_REMOTE_USERS];
+static fed_window_t windows[MAX_NODES];
+static int window_count = 0;
+static unsigned long long fed_seq = 0;
+static peer_t peers[MAX_PEERS];
+static int peer_count = 0;
+static char fed_secret[MAX_SECRET_LENGTH + 1];
+
+int fed_init(unsigned int node_id, const char* secret, const fed_hooks_t* fed_hooks)
+{
+    if (node_id == 0) {
+        fprintf(stderr, "the node id must be greater than 0\n");
+        return -1;
+    }
+    if (secret == NULL || *secret == '\0' || strlen(secret) > MAX_SECRET_LENGTH
+        || strpbrk(secret, " \t\r\n") != NULL) {
+        fprintf(stderr, "the federation needs a secret (-k), of up to %d characters and no spaces\n",
+                MAX_SECRET_LENGTH);
+        return -1;
+    }
+    strcpy(fed_secret, secret);
+    fed_node_id = node_id;
+    hooks = *fed_hooks;
+
+    // the sequence starts at the boot time in microseconds, so the events
+    // of a restarted node are not taken as duplicates of the old ones
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    fed_seq = (unsigned long long)tv.tv_sec * 1000000ull + tv.tv_usec;
+    return 0;
+}
+
+bool fed_check_duplicate(fed_window_t* window, unsigned long long seq)
+{
+    if (seq > window->highest) {
+        unsigned long long shift = seq - window->highest;
+        window->window = (shift >= 64) ? 0 : (window->window << shift);
+        window->window |= 1;
+        window->highest = seq;
+        return false;
+    }
+
+    unsigned long long offset = window->highest - seq;
+    if (offset >= 64) return true; // too old to tell, take it as seen
+    if (window->window & (1ull << offset)) return true;
+    window->window |= (1ull << offset);
+    return false;
+}
+
+// duplicate check of an event from origin, called with fed_lock held
+static bool seen_before(unsigned int origin, unsigned long long seq)
+{
+    for (int i = 0; i < window_count; i++) {
+        if (windows[i].origin == origin) {
+            return fed_check_duplicate(&windows[i], seq);
+        }
+    }
+    if (window_count == MAX_NODES) {
+        fprintf(stderr, "too many federated nodes, dropping events of node %u\n", origin);
+        return true;
+    }
+    windows[window_count].origin = origin;
+    windows[window_count].highest = seq;
+    windows[window_count].window = 1;
+    window_count++;
+    return false;
+}
+
+// add a client of another node to the roster, true if it is new
+static bool roster_add(const char* name, unsigned int origin, unsigned int via)
+{
+    int free_slot = -1;
+    bool known = false;
+
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_REMOTE_USERS && !known; i++) {
+        if (remote_users[i].name == NULL) {
+            if (free_slot < 0) { free_slot = i; }
+        } else {
+            known = (remote_users[i].origin == origin) && (0 == strcmp(remote_users[i].name, name));
+        }
+    }
+    bool added = false;
+    if (!known && free_slot >= 0) {
+        remote_users[free_slot].name = strdup(name);
+        remote_users[free_slot].origin = origin;
+        remote_users[free_slot].via = via;
+        added = (remote_users[free_slot].name != NULL);
+    }
+    pthread_mutex_unlock(&fed_lock);
+    return added;
+}
+
+static void roster_remove(const char* name, unsigned int origin)
+{
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        if ((remote_users[i].name != NULL) && (remote_users[i].origin == origin)
+            && (0 == strcmp(remote_users[i].name, name))) {
+            free(remote_users[i].name);
+            remote_users[i].name = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fed_lock);
+}
+
+bool fed_has_user(const char* name)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_REMOTE_USERS && !found; i++) {
+        found = (remote_users[i].name != NULL) && (0 == strcmp(remote_users[i].name, name));
+    }
+    pthread_mutex_unlock(&fed_lock);
+    return found;
+}
+
+size_t fed_append_roster(char* buf, size_t room)
+{
+    size_t length = 0;
+
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        if (remote_users[i].name == NULL) continue;
+
+        int n = snprintf(buf + length, room - length, "%s\n", remote_users[i].name);
+        if (n < 0 || (size_t)n >= room - length) { break; } // no more room
+        length += n;
+    }
+    pthread_mutex_unlock(&fed_lock);
+    return length;
+}
+
+/*
+ * queue a line in all the links but 'except' (-1 for all of them)
+ * all the lines of a link go in its control lane: they are sent in
+ * order, so the duplicates window sees the events of an origin in the
+ * order they were made, and they are never dropped as bulk frames are.
+ * A link that can not take one more (FED_LINK_LIMIT) is cut: its thread
+ * sees it closed and unregisters it
+ */
+static void send_to_links_locked(const char* line, size_t len, int except)
+{
+    frame_t* frame = frame_new(line, len);
+    if (frame == NULL) return;
+
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (links[i].used && (i != except)
+            && (outqueue_push(links[i].queue, LANE_CONTROL, frame) < 0) && !links[i].cut) {
+            fprintf(stderr, "link with node %u can not take more lines, closing it\n", links[i].node);
+            links[i].cut = true;
+            shutdown(links[i].fd, SHUT_RDWR);
+        }
+    }
+    frame_unref(frame);
+}
+
+static void send_to_links(const char* line, size_t len, int except)
+{
+    pthread_mutex_lock(&fed_lock);
+    send_to_links_locked(line, len, except);
+    pthread_mutex_unlock(&fed_lock);
+}
+
+// length of text without its trailing '\n'
+static size_t text_length(const char* text)
+{
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) { len--; }
+    return len;
+}
+
+/*
+ * publish - send an event of this node to all the links
+ * fields are joined with FED_SEP, the last one may end with '\n'
+ */
+static void publish(const char* type, const char* f1, const char* f2, const char* f3)
+{
+    if (fed_node_id == 0) return; // federation not enabled
+
+    char line[MAXLINE];
+    const char* fields[3] = { f1, f2, f3 };
+
+    // the events of this node are queued in the order of their seq
+    pthread_mutex_lock(&fed_lock);
+    unsigned long long seq = ++fed_seq;
+
+    int len = snprintf(line, sizeof(line), "FED %u %llu %s ", fed_node_id, seq, type);
+    for (int i = 0; i < 3 && fields[i] != NULL && len < (int)sizeof(line) - 2; i++) {
+        if (i > 0) { line[len++] = FED_SEP; }
+        size_t n = text_length(fields[i]);
+        if (n > sizeof(line) - 2 - len) { n = sizeof(line) - 2 - len; }
+        memcpy(line + len, fields[i], n);
+        len += n;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+
+    send_to_links_locked(line, len, -1);
+    pthread_mutex_unlock(&fed_lock);
+}
+
+void fed_publish_join(const char* name)
+{
+    publish("JOIN", name, NULL, NULL);
+}
+
+void fed_publish_leave(const char* name)
+{
+    publish("LEAVE", name, NULL, NULL);
+}
+
+void fed_publish_broadcast(const char* from, const char* text)
+{
+    publish("MSG", from, text, NULL);
+}
+
+void fed_publish_dm(const char* from, const char* to, const char* text)
+{
+    publish("DM", from, to, text);
+}
+
+static void publish_here(const char* name, void* arg)
+{
+    (void)arg;
+    publish("HERE", name, NULL, NULL);
+}
+
+// split 'rest' in place in up to 'max' fields separated by FED_SEP
+static int split_fields(char* rest, char** fields, int max)
+{
+    int count = 0;
+    fields[count++] = rest;
+    for (char* p = rest; *p != '\0' && count < max; p++) {
+        if (*p == FED_SEP) {
+            *p = '\0';
+            fields[count++] = p + 1;
+        }
+    }
+    return count;
+}
+
+// apply an event of another node to the local clients
+static void apply_event(const char* type, unsigned int origin, unsigned int via, char* rest)
+{
+    char* fields[3];
+    char text[MAXLINE];
+    int count = split_fields(rest, fields, 3);
+
+    if ((0 == strcmp(type, "JOIN")) && (count >= 1)) {
+        if (roster_add(fields[0], origin, via)) {
+            snprintf(text, sizeof(text), "%s has joined the chat room\n", fields[0]);
+            hooks.deliver_notice(text);
+        }
+    } else if ((0 == strcmp(type, "HERE")) && (count >= 1)) {
+        // a client that is still there, known again after a link was lost
+        roster_add(fields[0], origin, via);
+    } else if ((0 == strcmp(type, "SYNC"))) {
+        // a node lost a link, tell it again the clients of this one
+        hooks.for_each_local(publish_here, NULL);
+    } else if ((0 == strcmp(type, "LEAVE")) && (count >= 1)) {
+        // the good bye is a broadcast of its own, no notice here
+        roster_remove(fields[0], origin);
+    } else if ((0 == strcmp(type, "MSG")) && (count >= 2)) {
+        snprintf(text, sizeof(text), "%s\n", fields[1]);
+        hooks.deliver_broadcast(fields[0], text);
+    } else if ((0 == strcmp(type, "DM")) && (count >= 3)) {
+        snprintf(text, sizeof(text), "%s\n", fields[2]);
+        hooks.deliver_dm(fields[0], fields[1], text); // only one node has the client
+    }
+}
+
+// handle a line received from the link in position index
+static void handle_line(int index, unsigned int via, char* line)
+{
+    unsigned int origin = 0;
+    unsigned long long seq = 0;
+    char type[16];
+    int offset = 0;
+
+    size_t len = text_length(line);
+    line[len] = '\0';
+
+    if (1 == sscanf(line, "ROSTER %u %n", &origin, &offset) && offset > 0) {
+        if (origin != fed_node_id) {
+            roster_add(line + offset, origin, via);
+        }
+        return;
+    }
+
+    if (3 != sscanf(line, "FED %u %llu %15s %n", &origin, &seq, type, &offset) || offset == 0) {
+        fprintf(stderr, "unknown federation message from node %u: %s\n", via, line);
+        return;
+    }
+    if (origin == fed_node_id) return; // our own event, back from a loop
+
+    pthread_mutex_lock(&fed_lock);
+    bool duplicate = seen_before(origin, seq);
+    pthread_mutex_unlock(&fed_lock);
+    if (duplicate) return;
+
+    // forward first, the rest of the nodes should not wait for us
+    line[len] = '\n';
+    send_to_links(line, len + 1, index);
+    line[len] = '\0';
+
+    apply_event(type, origin, via, line + offset);
+}
+
+static int register_link(int fd, unsigned int node, outqueue_t* queue)
+{
+    int index = -1;
+
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (!links[i].used) {
+            links[i].used = true;
+            links[i].fd = fd;
+            links[i].cut = false;
+            links[i].node = node;
+            links[i].queue = queue;
+            index = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fed_lock);
+    return index;
+}
+
+/*
+ * remove a link, and the clients learned through it if it was the last
+ * one to that node. Some of them may still be reachable through the
+ * other links: ask all the nodes that are, with a SYNC, to tell their
+ * clients again
+ */
+static void unregister_link(int index)
+{
+    int removed = 0;
+
+    pthread_mutex_lock(&fed_lock);
+    unsigned int node = links[index].node;
+    links[index].used = false;
+    links[index].queue = NULL;
+
+    bool other_link = false;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        other_link = other_link || (links[i].used && links[i].node == node);
+    }
+    for (int i = 0; i < MAX_REMOTE_USERS && !other_link; i++) {
+        if ((remote_users[i].name != NULL) && (remote_users[i].via == node)) {
+            free(remote_users[i].name);
+            remote_users[i].name = NULL;
+            removed++;
+        }
+    }
+    pthread_mutex_unlock(&fed_lock);
+    fprintf(stdout, "link with node %u closed\n", node);
+
+    if (removed > 0) {
+        publish("SYNC", NULL, NULL, NULL);
+    }
+}
+
+static void send_roster_entry(const char* name, void* arg)
+{
+    char line[MAXLINE];
+    int len = snprintf(line, sizeof(line), "ROSTER %u %s\n", fed_node_id, name);
+    outqueue_send((outqueue_t*)arg, LANE_CONTROL, line, len);
+}
+
+// send all the clients we know to a new link
+static void send_roster(outqueue_t* queue)
+{
+    char line[MAXLINE];
+
+    hooks.for_each_local(send_roster_entry, queue);
+
+    pthread_mutex_lock(&fed_lock);
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        if (remote_users[i].name == NULL) continue;
+        int len = snprintf(line, sizeof(line), "ROSTER %u %s\n", remote_users[i].origin, remote_users[i].name);
+        outqueue_send(queue, LANE_CONTROL, line, len);
+    }
+    pthread_mutex_unlock(&fed_lock);
+}
+
+static void send_hello(outqueue_t* queue)
+{
+    char line[MAX_SECRET_LENGTH + 32];
+    int len = snprintf(line, sizeof(line), "PEER %u %s\n", fed_node_id, fed_secret);
+    outqueue_send(queue, LANE_CONTROL, line, len);
+}
+
+/*
+ * parse_hello - the node id of a PEER line with the right secret,
+ * 0 if it is not one
+ */
+static unsigned int parse_hello(const char* line)
+{
+    unsigned int node = 0;
+    char secret[MAX_SECRET_LENGTH + 2];
+
+    if (2 != sscanf(line, "PEER %u %65s", &node, secret)) return 0;
+
+    // compare all the bytes, the time does not tell how many matched
+    size_t len = strlen(secret);
+    unsigned char diff = (len != strlen(fed_secret));
+    for (size_t i = 0; i < len && i < sizeof(fed_secret); i++) {
+        diff |= (unsigned char)secret[i] ^ (unsigned char)fed_secret[i];
+    }
+    return (diff == 0) ? node : 0;
+}
+
+/*
+ * run_link - serve a link until it is closed. hello is the PEER
+ * line of the other end, or NULL to wait for it.
+ */
+static void run_link(transport_t* transport, outqueue_t* queue, linebuf_t* input, const char* hello)
+{
+    char line[MAXLINE];
+    unsigned int node = 0;
+    ssize_t n = 1;
+    int fd = transport->fd;
+
+    if (hello == NULL) {
+        // we connected, wait for the answer to our hello
+        bool answered = false;
+        while (!answered && n > 0) {
+            n = transport_fill(transport, input, false);
+            if (linebuf_getline(input, line, sizeof(line)) > 0) {
+                answered = true;
+                node = parse_hello(line);
+            }
+        }
+    } else {
+        node = parse_hello(hello);
+        if (node != 0) { send_hello(queue); } // never tell the secret to a stranger
+    }
+
+    if (node == 0 || node == fed_node_id) {
+        fprintf(stderr, "invalid federation peer on fd %d (wrong node id or secret)\n", fd);
+        return;
+    }
+
+    int index = register_link(fd, node, queue);
+    if (index < 0) {
+        fprintf(stderr, "too many federation links, closing the one with node %u\n", node);
+        return;
+    }
+    fprintf(stdout, "link with node %u ready\n", node);
+    outqueue_limit_control(queue, FED_LINK_LIMIT);
+    send_roster(queue);
+
+    // the hello may have come with more lines
+    while (linebuf_getline(input, line, sizeof(line)) > 0) {
+        handle_line(index, node, line);
+    }
+    while ((n = transport_fill(transport, input, false)) > 0) {
+        while (linebuf_getline(input, line, sizeof(line)) > 0) {
+            handle_line(index, node, line);
+        }
+    }
+
+    unregister_link(index);
+}
+
+void fed_serve_link(transport_t* transport, outqueue_t* queue, linebuf_t* input, const char* hello)
+{
+    if (fed_node_id == 0) {
+        fprintf(stderr, "federation link refused, this server has no node id\n");
+        return;
+    }
+    run_link(transport, queue, input, hello);
+}
+
+/*
+ * PeerConnector - thread function that keeps the link with
+ * a configured peer, connecting again when it is lost
+ */
+static void* PeerConnector(void* arg)
+{
+    peer_t* peer = (peer_t*)arg;
+
+    pthread_detach(pthread_self());
+
+    while (1) {
+        int fd = open_clientfd(peer->host, peer->port);
+        if (fd >= 0) {
+            transport_t transport;
+            linebuf_t input;
+            transport_init_socket(&transport, fd);
+            linebuf_init(&input);
+
+            outqueue_t* queue = outqueue_create(fd);
+            if (queue != NULL) {
+                send_hello(queue);
+                run_link(&transport, queue, &input, NULL);
+                outqueue_destroy(queue, false);
+            }
+            close(fd);
+        }
+        sleep(PEER_RETRY_SEC);
+    }
+    return NULL;
+}
+
+int fed_add_peer(const char* peer)
+{
+    if (fed_node_id == 0) {
+        fprintf(stderr, "a node id is needed to add peers\n");
+        return -1;
+    }
+    if (peer_count == MAX_PEERS) {
+        fprintf(stderr, "too many peers, the max is %d\n", MAX_PEERS);
+        return -1;
+    }
+
+    const char* colon = strrchr(peer, ':');
+    if (colon == NULL || colon == peer || (size_t)(colon - peer) >= sizeof(peers[0].host)) {
+        fprintf(stderr, "invalid peer %s, use host:port\n", peer);
+        return -1;
+    }
+
+    peer_t* p = &peers[peer_count];
+    memcpy(p->host, peer, colon - peer);
+    p->host[colon - peer] = '\0';
+    p->port = atoi(colon + 1);
+    if (p->port <= 0) {
+        fprintf(stderr, "invalid port in peer %s\n", peer);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, PeerConnector, p) != 0) {
+        fprintf(stderr, "Error creating the thread of peer %s\n", peer);
+        return -1;
+    }
+    peer_count++;
+    return 0;
+}
@@ -0,0 +1,110 @@
+// chatfed.h - federation of several chat servers
+//
+// Servers configured as peers keep persistent links between them and
+// relay the broadcasts, the direct messages and the presence (JOIN and
+// LEAVE) of their clients, so all of them share a single chat room.
+//
+// A link is a TCP connection to the same port as the clients, where
+// both ends first send "PEER <node id> <secret>": the secret shared by
+// all the nodes, a connection without it is not a link and is closed.
+// Then the relayed events are lines of the form:
+//
+//     FED <origin> <seq> <type> <fields separated by FED_SEP>
+//
+// <origin> is the node id of the server where the event happened and
+// <seq> a number that grows with every event of that origin. Every node
+// forwards the events to all its other links, and drops the ones it
+// already saw, so the events reach all the nodes of any topology (a
+// chain, a ring or a full mesh) without loops.
+//
+// When a link comes up, each end sends its roster ("ROSTER <origin>
+// <name>" lines, not forwarded) so WHO can list the clients of every
+// node. The clients learned through a link are forgotten when the link
+// goes down; the node then floods a SYNC event, and every node that
+// still gets it answers with a HERE event per local client, so the
+// clients reachable through the other links are known again.
+//
+// The lines of a link are never dropped, they are sent in order. A peer
+// that does not read them fast enough (FED_LINK_LIMIT bytes waiting) is
+// closed instead, and learns the state again when it connects back.
+
+#ifndef __CHAT_FED
+#define __CHAT_FED
+
+#include "chatqueue.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_PEERS (16)          // configured peers, and live links
+#define MAX_REMOTE_USERS (1024) // clients of the other nodes
+#define MAX_NODES (64)          // origins tracked for the duplicates
+#define FED_SEP '\x1f'          // separator of the fields, names may have spaces
+#define PEER_RETRY_SEC (2)      // wait before connecting again to a peer
+#define MAX_SECRET_LENGTH (64)  // of the secret shared by the nodes
+#define FED_LINK_LIMIT (4 * 1024 * 1024) // bytes waiting for a peer before the link is closed
+
+// calls from the federation into the server, to reach the local clients
+typedef struct {
+    // send "[from] text" to all the local clients
+    void (*deliver_broadcast)(const char* from, const char* text);
+    // send a notice, as is, to all the local clients
+    void (*deliver_notice)(const char* text);
+    // send "[from] (DM) text" to the local client 'to', false if not here
+    bool (*deliver_dm)(const char* from, const char* to, const char* text);
+    // call fn for the name of every local client
+    void (*for_each_local)(void (*fn)(const char* name, void* arg), void* arg);
+} fed_hooks_t;
+
+// the node id of this server, 0 when the federation is not enabled
+extern unsigned int fed_node_id;
+
+/*
+ * fed_init - enable the federation for node 'node_id', with the secret
+ * of the links (no spaces, up to MAX_SECRET_LENGTH characters)
+ * return -1 in case of failure
+ */
+int fed_init(unsigned int node_id, const char* secret, const fed_hooks_t* hooks);
+
+/*
+ * fed_add_peer - keep a link to the peer "host:port", from a
+ * thread that connects again every time the link is lost
+ * return -1 in case of failure
+ */
+int fed_add_peer(const char* peer);
+
+/*
+ * fed_serve_link - serve an incoming link, 'hello' is the PEER line
+ * already read from the connection, and input may have the next ones.
+ * return when the link is closed.
+ */
+void fed_serve_link(transport_t* transport, outqueue_t* queue, linebuf_t* input, const char* hello);
+
+// relay the events of the local clients to the other nodes
+void fed_publish_join(const char* name);
+void fed_publish_leave(const char* name);
+void fed_publish_broadcast(const char* from, const char* text);
+void fed_publish_dm(const char* from, const char* to, const char* text);
+
+// true if 'name' is a client of another node
+bool fed_has_user(const char* name);
+
+/*
+ * fed_append_roster - append the names of the clients of the other
+ * nodes, one per line, to buf (of size room)
+ * return the number of bytes appended
+ */
+size_t fed_append_roster(char* buf, size_t room);
+
+/*
+ * fed_check_duplicate - sliding window of the sequence numbers seen
+ * from one origin, true if seq was already seen (or is too old)
+ */
+typedef struct {
+    unsigned int origin;
+    unsigned long long highest;
+    unsigned long long window; // bit i: seq (highest - i) was seen
+} fed_window_t;
+
+bool fed_check_duplicate(fed_window_t* window, unsigned long long seq);
+
+#endif //__CHAT_FED
@@ -0,0 +1,83 @@
+// chatproto.c - parsing and formatting of the chat protocol messages
+#include "chatproto.h"
+#include <string.h>
+
+bool checkCommand(const char* command, char* message) {
+    if (*command == '\0') return false;
+    if (*message == '\0') return false;
+
+    if (0 == strncmp(message, command, strlen(command)) ) {
+	return true;
+    }
+    return false;
+}
+
+bool checkWHO(char* message) {
+    return checkCommand("WHO", message);
+}
+
+bool checkJOIN(char* message) {
+    return checkCommand("JOIN ", message);
+}
+
+bool checkLEAVE(char* message) {
+    return checkCommand("LEAVE", message);
+}
+
+bool checkVERSION(char* message) {
+    return checkCommand("VERSION", message);
+}
+
+bool checkDM(char* message) {
+    return checkCommand("DM ", message);
+}
+
+bool checkPEER(char* message) {
+    return checkCommand("PEER ", message);
+}
+
+bool checkCOMPRESS(char* message) {
+    return checkCommand("COMPRESS ", message);
+}
+
+command_t parseCommand(char* message, bool joined)
+{
+    if (!joined) {
+        if (checkJOIN(message)) return CMD_JOIN;
+        if (checkPEER(message)) return CMD_PEER;
+        if (checkCOMPRESS(message)) return CMD_COMPRESS;
+        return CMD_NONE;
+    }
+
+    if (checkWHO(message))     return CMD_WHO;
+    if (checkLEAVE(message))   return CMD_LEAVE;
+    if (checkVERSION(message)) return CMD_VERSION;
+    if (checkDM(message))      return CMD_DM;
+    if (checkCOMPRESS(message)) return CMD_COMPRESS;
+
+    return CMD_BROADCAST;
+}
+
+int formatBroadcast(char* out, size_t outlen, const char* name, const char* msg)
+{
+    if (outlen == 0) return 0;
+
+    // "[" name "] " msg, the same output as the old strcat() chain
+    // but without rescanning the buffer for every piece
+    size_t name_len = strlen(name);
+    size_t msg_len = strlen(msg);
+    size_t len = 0;
+    size_t room = outlen - 1; // keep space for '\0'
+
+    const char* pieces[4] = { "[", name, "] ", msg };
+    size_t sizes[4] = { 1, name_len, 2, msg_len };
+
+    for (int i = 0; i < 4 && len < room; i++) {
+        size_t n = sizes[i];
+        if (n > room - len) { n = room - len; }
+        memcpy(out + len, pieces[i], n);
+        len += n;
+    }
+    out[len] = '\0';
+    return (int)len;
+}
@@ -0,0 +1,63 @@
+// chat protocol helpers shared by the server and the microbenchmarks.
+// These functions do not touch sockets nor the array of clients, so
+// they can be called without a running server.
+
+#ifndef __CHAT_PROTO
+#define __CHAT_PROTO
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// commands understood by the server
+typedef enum {
+    CMD_NONE = 0,   // nothing to do (ex: not joined and not a JOIN)
+    CMD_JOIN,
+    CMD_WHO,
+    CMD_LEAVE,
+    CMD_VERSION,
+    CMD_DM,         // direct message: DM name text
+    CMD_PEER,       // federation link from another server: PEER node
+    CMD_COMPRESS,   // compression of what the client gets: COMPRESS class
+    CMD_BROADCAST
+} command_t;
+
+// true if 'message' starts with 'command'
+bool checkCommand(const char* command, char* message);
+
+// check WHO command
+bool checkWHO(char* message);
+
+// check JOIN command
+bool checkJOIN(char* message);
+
+// check LEAVE command
+bool checkLEAVE(char* message);
+
+// check VERSION command
+bool checkVERSION(char* message);
+
+// check DM command
+bool checkDM(char* message);
+
+// check PEER command
+bool checkPEER(char* message);
+
+// check COMPRESS command
+bool checkCOMPRESS(char* message);
+
+/*
+ * parseCommand - classify a line received from a client
+ * 'joined' tells if the client already used JOIN, clients that
+ * did not join can only use the JOIN command (or PEER, if they are
+ * another server), and COMPRESS.
+ */
+command_t parseCommand(char* message, bool joined);
+
+/*
+ * formatBroadcast - build the frame "[name] msg" sent to the
+ * rest of the chat participants into 'out'
+ * return the length of the frame (truncated to outlen - 1)
+ */
+int formatBroadcast(char* out, size_t outlen, const char* name, const char* msg);
+
+#endif //__CHAT_PROTO
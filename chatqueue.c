@@ -0,0 +1,432 @@
+// chatqueue.c - outbound queues with control and bulk priority lanes
+#define _GNU_SOURCE // for pthread_timedjoin_np
+#include "chatqueue.h"
+#include "nethelp.h"
+#include <errno.h>
+#include <time.h>
+
+#define FLUSH_TIMEOUT_SEC (2) // max time to flush a queue when closing
+
+// frame_t.zipped of a frame not worth compressing, and of a frame that
+// had to be compressed but could not: never sent raw, it would look
+// like a record to the client
+static zipped_t send_as_is;
+static zipped_t send_nothing;
+
+queue_config_t queue_config = {
+    .policy = SCHED_STRICT,
+    .control_weight = 4,
+    .bulk_limit = DEFAULT_BULK_LIMIT,
+    .sndbuf = DEFAULT_SNDBUF,
+};
+
+frame_t* frame_new(const char* data, size_t len)
+{
+    frame_t* frame = malloc(sizeof(frame_t) + len);
+    if (frame == NULL) return NULL;
+
+    frame->refs = 1;
+    frame->trace_id = trace_current.id;
+    frame->traced = trace_current.sampled;
+    memset(frame->zipped, 0, sizeof(frame->zipped));
+    frame->len = len;
+    memcpy(frame->data, data, len);
+    return frame;
+}
+
+void frame_ref(frame_t* frame)
+{
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+void frame_unref(frame_t* frame)
+{
+    if (frame == NULL) return;
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (int i = 0; i < ZIP_CLASSES; i++) {
+            if (frame->zipped[i] != &send_as_is && frame->zipped[i] != &send_nothing) {
+                free(frame->zipped[i]);
+            }
+        }
+        free(frame);
+    }
+}
+
+void frame_encode(frame_t* frame, zip_class_t zclass, const char** data, size_t* len)
+{
+    *data = frame->data;
+    *len = frame->len;
+    if (zclass <= ZIP_NONE || zclass >= ZIP_CLASSES) return;
+
+    zipped_t* zipped = __atomic_load_n(&frame->zipped[zclass], __ATOMIC_ACQUIRE);
+    if (zipped == NULL) {
+        size_t room = zip_bound(frame->len);
+        zipped = malloc(sizeof(zipped_t) + room);
+        int n = (zipped == NULL) ? -1 : zip_compress(zclass, frame->data, frame->len, zipped->data, room);
+        if (n >= 0) {
+            zipped->len = n;
+        } else {
+            free(zipped);
+            if (zip_forced(frame->data, frame->len)) {
+                fprintf(stderr, "a message could not be compressed, it is not sent\n");
+                zipped = &send_nothing;
+            } else {
+                zipped = &send_as_is;
+            }
+        }
+        // writers of other queues may be doing the same, the first one wins
+        zipped_t* expected = NULL;
+        if (!__atomic_compare_exchange_n(&frame->zipped[zclass], &expected, zipped, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (zipped != &send_as_is && zipped != &send_nothing) { free(zipped); }
+            zipped = expected;
+        }
+    }
+    if (zipped != &send_as_is) {
+        *data = zipped->data;
+        *len = zipped->len;
+    }
+}
+
+static void lane_clear(lane_queue_t* lane)
+{
+    frame_node_t* node = lane->head;
+    while (node != NULL) {
+        frame_node_t* next = node->next;
+        frame_unref(node->frame);
+        free(node);
+        node = next;
+    }
+    lane->head = lane->tail = NULL;
+    lane->bytes = 0;
+}
+
+// choose the lane of the next frame to send, called with the lock held
+static lane_t pick_lane(outqueue_t* queue)
+{
+    bool control = (queue->lanes[LANE_CONTROL].head != NULL);
+    bool bulk = (queue->lanes[LANE_BULK].head != NULL);
+    lane_t lane;
+
+    if (control && bulk && (queue_config.policy == SCHED_WEIGHTED)
+        && (queue->control_streak >= queue_config.control_weight)) {
+        lane = LANE_BULK;  // give the bulk lane its turn
+    } else {
+        lane = control ? LANE_CONTROL : LANE_BULK;
+    }
+
+    queue->control_streak = (lane == LANE_CONTROL) ? queue->control_streak + 1 : 0;
+    return lane;
+}
+
+static bool queue_empty(outqueue_t* queue)
+{
+    return (queue->lanes[LANE_CONTROL].head == NULL) && (queue->lanes[LANE_BULK].head == NULL);
+}
+
+// the compression of a node taken to be sent, called with the lock held
+static zip_class_t taken_class(outqueue_t* queue, frame_node_t* node)
+{
+    zip_class_t zclass = queue->zip_class;
+    if (node->zip_switch >= 0) { queue->zip_class = node->zip_switch; }
+    return zclass;
+}
+
+/*
+ * QueueWriter - thread function that sends the queued frames
+ * of one connection into its socket
+ */
+static void* QueueWriter(void* arg)
+{
+    outqueue_t* queue = (outqueue_t*)arg;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (!queue->closing && (queue->failed || queue_empty(queue))) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        }
+        if (queue->closing && (!queue->flush || queue->failed || queue_empty(queue))) {
+            break;
+        }
+
+        lane_t lane = pick_lane(queue);
+        lane_queue_t* lq = &queue->lanes[lane];
+        frame_node_t* node = lq->head;
+        lq->head = node->next;
+        if (lq->head == NULL) { lq->tail = NULL; }
+        lq->bytes -= node->frame->len;
+
+        // never hold the lock while blocked in the socket
+        zip_class_t zclass = taken_class(queue, node);
+        pthread_mutex_unlock(&queue->lock);
+
+        const char* data;
+        size_t len;
+        frame_encode(node->frame, zclass, &data, &len);
+        int rv = transport_write(&queue->transport, data, len);
+        queue->raw_bytes += node->frame->len;
+        queue->sent_bytes += len;
+        TRACE_FRAME_HOP(write, TRACE_WRITE, node->frame->trace_id, node->frame->traced,
+                        queue->transport.fd, (rv < 0) ? -1 : (long)len);
+        frame_unref(node->frame);
+        free(node);
+        pthread_mutex_lock(&queue->lock);
+
+        if (rv < 0) {
+            // the client is gone, discard everything from now on
+            queue->failed = true;
+            lane_clear(&queue->lanes[LANE_CONTROL]);
+            lane_clear(&queue->lanes[LANE_BULK]);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+outqueue_t* outqueue_create(int fd)
+{
+    transport_t transport;
+    transport_init_socket(&transport, fd);
+    return outqueue_create_transport(&transport);
+}
+
+static outqueue_t* queue_alloc(const transport_t* transport)
+{
+    outqueue_t* queue = calloc(1, sizeof(outqueue_t));
+    if (queue == NULL) return NULL;
+
+    queue->transport = *transport;
+    int fd = transport->fd;
+    if ((queue_config.sndbuf > 0) && (transport->shm == NULL)) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &queue_config.sndbuf, sizeof(queue_config.sndbuf));
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    return queue;
+}
+
+outqueue_t* outqueue_create_notify(int fd, outqueue_notify_t notify, void* arg)
+{
+    transport_t transport;
+    transport_init_socket(&transport, fd);
+    outqueue_t* queue = queue_alloc(&transport);
+    if (queue == NULL) return NULL;
+
+    queue->notify = notify;
+    queue->notify_arg = arg;
+    return queue;
+}
+
+outqueue_t* outqueue_create_transport(const transport_t* transport)
+{
+    outqueue_t* queue = queue_alloc(transport);
+    if (queue == NULL) return NULL;
+
+    if (pthread_create(&queue->writer, NULL, QueueWriter, queue) != 0) {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->cond);
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+static void lane_append(outqueue_t* queue, lane_t lane, frame_node_t* node)
+{
+    lane_queue_t* lq = &queue->lanes[lane];
+    node->next = NULL;
+    if (lq->tail != NULL) {
+        lq->tail->next = node;
+    } else {
+        lq->head = node;
+    }
+    lq->tail = node;
+    lq->bytes += node->frame->len;
+}
+
+// queued in the control lane when the bulk lane starts dropping, so the
+// client knows chat messages are missing. Once per run of drops.
+static const char DROP_NOTICE[] = "Messages dropped, you are too slow\n";
+
+static bool notify_drop(outqueue_t* queue)
+{
+    if (queue->dropping) return false;
+    frame_node_t* node = malloc(sizeof(frame_node_t));
+    frame_t* notice = frame_new(DROP_NOTICE, sizeof(DROP_NOTICE) - 1);
+    if (node == NULL || notice == NULL) {
+        free(node);
+        if (notice != NULL) frame_unref(notice);
+        return false;
+    }
+    queue->dropping = true;
+    bool wake = (queue->notify != NULL) && queue_empty(queue);
+    node->frame = notice;
+    node->zip_switch = -1;
+    lane_append(queue, LANE_CONTROL, node);
+    pthread_cond_signal(&queue->cond);
+    return wake;
+}
+
+static int push_node(outqueue_t* queue, lane_t lane, frame_t* frame, int zip_switch)
+{
+    if (queue == NULL || frame == NULL) return -1;
+
+    frame_node_t* node = malloc(sizeof(frame_node_t));
+    if (node == NULL) return -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->closing || queue->failed
+        || ((lane == LANE_BULK) && (queue->lanes[LANE_BULK].bytes + frame->len > queue_config.bulk_limit))
+        || ((lane == LANE_CONTROL) && (queue->control_limit > 0)
+            && (queue->lanes[LANE_CONTROL].bytes + frame->len > queue->control_limit))) {
+        bool wake = false;
+        if ((lane == LANE_BULK) && !queue->closing && !queue->failed) {
+            queue->dropped++;
+            wake = notify_drop(queue);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        free(node);
+        if (wake) {
+            queue->notify(queue, queue->notify_arg);
+        }
+        return -1;
+    }
+
+    bool wake = (queue->notify != NULL) && queue_empty(queue);
+    if ((lane == LANE_BULK) && (queue->lanes[LANE_BULK].head == NULL)) {
+        queue->dropping = false; // caught up, report the next drops again
+    }
+    frame_ref(frame);
+    node->frame = frame;
+    node->zip_switch = zip_switch;
+    lane_append(queue, lane, node);
+    TRACE_FRAME_HOP(enqueue, TRACE_ENQUEUE, frame->trace_id, frame->traced, queue->transport.fd, frame->len);
+
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    // frames queued before are already known by the event loop
+    if (wake) {
+        queue->notify(queue, queue->notify_arg);
+    }
+    return 0;
+}
+
+int outqueue_push(outqueue_t* queue, lane_t lane, frame_t* frame)
+{
+    return push_node(queue, lane, frame, -1);
+}
+
+int outqueue_send(outqueue_t* queue, lane_t lane, const char* data, size_t len)
+{
+    frame_t* frame = frame_new(data, len);
+    if (frame == NULL) return -1;
+
+    int rv = outqueue_push(queue, lane, frame);
+    frame_unref(frame);
+    return rv;
+}
+
+void outqueue_limit_control(outqueue_t* queue, size_t bytes)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->control_limit = bytes;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int outqueue_send_compression(outqueue_t* queue, const char* data, size_t len, zip_class_t zclass)
+{
+    frame_t* frame = frame_new(data, len);
+    if (frame == NULL) return -1;
+
+    int rv = push_node(queue, LANE_CONTROL, frame, zclass);
+    frame_unref(frame);
+    return rv;
+}
+
+void outqueue_destroy(outqueue_t* queue, bool flush)
+{
+    if (queue == NULL) return;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->closing = true;
+    queue->flush = flush;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (queue->notify != NULL) {
+        queue->notify(queue, queue->notify_arg);
+        return;
+    }
+
+    // the writer may be blocked in send() on a client that does not
+    // read anymore: give it some time to flush, then cut the socket
+    bool joined = false;
+    if (flush) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_TIMEOUT_SEC;
+        joined = (pthread_timedjoin_np(queue->writer, NULL, &deadline) == 0);
+    }
+    if (!joined) {
+        shutdown(queue->transport.fd, SHUT_RDWR);
+        pthread_join(queue->writer, NULL);
+    }
+    outqueue_free(queue);
+}
+
+int outqueue_take(outqueue_t* queue, frame_t** frames, zip_class_t* classes, int max, size_t max_bytes)
+{
+    int count = 0;
+    size_t bytes = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (count < max && bytes < max_bytes && !queue->failed && !queue_empty(queue)) {
+        lane_queue_t* lq = &queue->lanes[pick_lane(queue)];
+        frame_node_t* node = lq->head;
+        lq->head = node->next;
+        if (lq->head == NULL) { lq->tail = NULL; }
+        lq->bytes -= node->frame->len;
+
+        classes[count] = taken_class(queue, node);
+        frames[count++] = node->frame;
+        bytes += node->frame->len;
+        free(node);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+bool outqueue_closing(outqueue_t* queue, bool* flush)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool closing = queue->closing;
+    *flush = queue->flush && !queue->failed;
+    pthread_mutex_unlock(&queue->lock);
+    return closing;
+}
+
+void outqueue_fail(outqueue_t* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->failed = true;
+    lane_clear(&queue->lanes[LANE_CONTROL]);
+    lane_clear(&queue->lanes[LANE_BULK]);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void outqueue_free(outqueue_t* queue)
+{
+    if (queue->dropped > 0) {
+        fprintf(stdout, "fd %d: %lu bulk frames dropped (slow client)\n", queue->transport.fd, queue->dropped);
+    }
+    if (queue->zip_class != ZIP_NONE) {
+        fprintf(stdout, "fd %d: %llu bytes sent for %llu (compression %s)\n", queue->transport.fd,
+                queue->sent_bytes, queue->raw_bytes, zip_class_name(queue->zip_class));
+    }
+    lane_clear(&queue->lanes[LANE_CONTROL]);
+    lane_clear(&queue->lanes[LANE_BULK]);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
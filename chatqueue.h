@@ -0,0 +1,194 @@
+// chatqueue.h - outbound queues of the chat server connections
+//
+// Every connection has its own outbound queue with two priority lanes:
+//  - control: answers to the commands of the client (JOIN welcome, WHO,
+//    VERSION, ...). Small and few, they are never dropped.
+//  - bulk: chat traffic (broadcasts, join/leave notices of others).
+//    Bounded, when a client does not read fast enough the newest bulk
+//    frames are dropped instead of growing without limit, and the client
+//    gets one control notice per run of drops.
+//
+// A writer thread per connection drains the queue into the socket, with
+// strict priority for the control lane, or a weighted round robin so the
+// bulk lane is not starved. This way a control answer waits at most for
+// one bulk frame, no matter how long the bulk backlog is.
+// The kernel send buffer of the socket is kept small, otherwise the
+// backlog would pile up there, out of reach of the scheduler.
+//
+// A connection may ask for compression (see chatzip.h): the frames are
+// compressed when they are written, once per class of compression, and
+// the result kept in the frame for the other recipients of the class.
+//
+// A queue may also be drained by an event loop (the io_uring backend)
+// instead of a writer thread: it is told with a callback when frames
+// arrive, and takes them with outqueue_take().
+
+#ifndef __CHAT_QUEUE
+#define __CHAT_QUEUE
+
+#include "chattransport.h"
+#include "chattrace.h"
+#include "chatzip.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFAULT_BULK_LIMIT (256 * 1024) // max bytes waiting in the bulk lane
+#define DEFAULT_SNDBUF (16 * 1024)      // kernel send buffer of the connections
+
+typedef enum {
+    LANE_CONTROL = 0,
+    LANE_BULK,
+    LANES
+} lane_t;
+
+typedef enum {
+    SCHED_STRICT = 0,   // control first, always
+    SCHED_WEIGHTED      // up to 'control_weight' control frames per bulk frame
+} sched_policy_t;
+
+// scheduling settings, shared by all the queues
+typedef struct {
+    sched_policy_t policy;
+    int control_weight;
+    size_t bulk_limit;
+    int sndbuf;     // SO_SNDBUF of the connections, 0 keeps the default
+} queue_config_t;
+
+extern queue_config_t queue_config;
+
+// a frame as sent to the connections of a class of compression
+typedef struct {
+    size_t len;
+    char data[];
+} zipped_t;
+
+/*
+ * frame - a message ready to be sent, reference counted so a broadcast
+ * is built once and shared by all the recipients queues
+ */
+typedef struct frame {
+    int refs;
+    unsigned long long trace_id;    // message that made it, see chattrace.h
+    bool traced;                    // its hops are recorded
+    zipped_t* zipped[ZIP_CLASSES];  // compressed, made by the first writer
+    size_t len;
+    char data[];
+} frame_t;
+
+// allocate a frame holding a copy of data, with one reference.
+// it belongs to the message handled by the thread, if any
+frame_t* frame_new(const char* data, size_t len);
+void frame_ref(frame_t* frame);
+void frame_unref(frame_t* frame);
+
+/*
+ * frame_encode - the bytes to write of frame for a connection with
+ * compression zclass: the record of chatzip.h, or the frame as is
+ */
+void frame_encode(frame_t* frame, zip_class_t zclass, const char** data, size_t* len);
+
+typedef struct frame_node {
+    frame_t* frame;
+    int zip_switch;     // compression of the frames sent after it, -1 keeps it
+    struct frame_node* next;
+} frame_node_t;
+
+typedef struct {
+    frame_node_t* head;
+    frame_node_t* tail;
+    size_t bytes;   // bytes waiting in the lane
+} lane_queue_t;
+
+typedef struct outqueue outqueue_t;
+
+// tells the event loop draining a queue that it has frames or is closing
+typedef void (*outqueue_notify_t)(outqueue_t* queue, void* arg);
+
+struct outqueue {
+    transport_t transport;  // where the frames are written
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    lane_queue_t lanes[LANES];
+    int control_streak;     // control frames sent in a row (weighted policy)
+    bool closing;           // no more frames will be queued
+    bool flush;             // send the pending frames before closing
+    bool failed;            // the socket failed, frames are discarded
+    unsigned long dropped;  // bulk frames dropped because of the limit
+    bool dropping;          // the client was told, until its bulk lane drains
+    size_t control_limit;   // max bytes waiting in the control lane, 0: no limit
+    int zip_class;          // compression of the next frame taken, ZIP_NONE
+    unsigned long long raw_bytes;  // bytes of the frames written, and
+    unsigned long long sent_bytes; // once compressed, by the writer
+    pthread_t writer;
+    outqueue_notify_t notify; // no writer thread if set
+    void* notify_arg;
+};
+
+/*
+ * outqueue_create - create the queue of connection fd and start its
+ * writer thread. return NULL in case of failure
+ */
+outqueue_t* outqueue_create(int fd);
+
+// the same, for a connection with any transport
+outqueue_t* outqueue_create_transport(const transport_t* transport);
+
+/*
+ * outqueue_create_notify - create the queue of socket fd without writer
+ * thread, notify is called (from any thread) when frames are queued in
+ * an empty queue and when it is destroyed. return NULL in case of failure
+ */
+outqueue_t* outqueue_create_notify(int fd, outqueue_notify_t notify, void* arg);
+
+/*
+ * outqueue_push - queue a frame in a lane, the queue takes its own
+ * reference to the frame. return -1 if the frame was dropped
+ */
+int outqueue_push(outqueue_t* queue, lane_t lane, frame_t* frame);
+
+// copy data into a new frame and queue it
+int outqueue_send(outqueue_t* queue, lane_t lane, const char* data, size_t len);
+
+/*
+ * outqueue_limit_control - refuse the control frames once bytes are
+ * waiting in the control lane. For the queues of peers that can not
+ * lose a frame: past the limit the owner closes the connection instead
+ */
+void outqueue_limit_control(outqueue_t* queue, size_t bytes);
+
+/*
+ * outqueue_destroy - stop the writer thread and free the queue.
+ * if flush is true the pending frames are sent first.
+ * the socket is not closed, nor the transport released.
+ * a queue without writer is only marked as closing, and notified: the
+ * event loop sends the pending frames if flush, then frees it.
+ */
+void outqueue_destroy(outqueue_t* queue, bool flush);
+
+/*
+ * outqueue_send_compression - queue data, the answer to a COMPRESS
+ * request, in the control lane: it is sent with the compression of the
+ * frames before it, and the frames sent after it with zclass, so the
+ * client knows where the records begin (or end)
+ */
+int outqueue_send_compression(outqueue_t* queue, const char* data, size_t len, zip_class_t zclass);
+
+/*
+ * outqueue_take - remove up to max frames (and about max_bytes) to send
+ * them, in the order of the lanes scheduling, with the compression of
+ * each one in classes. The caller owns them.
+ * return the number of frames
+ */
+int outqueue_take(outqueue_t* queue, frame_t** frames, zip_class_t* classes, int max, size_t max_bytes);
+
+// true if the queue was destroyed, and then if it has to be flushed
+bool outqueue_closing(outqueue_t* queue, bool* flush);
+
+// the socket failed: discard the pending frames and the next ones
+void outqueue_fail(outqueue_t* queue);
+
+// free a queue without writer thread, once closing
+void outqueue_free(outqueue_t* queue);
+
+#endif //__CHAT_QUEUE
@@ -0,0 +1,444 @@
+/*
+ * chatreplay.c - replay a capture of chatserver against a server
+ *
+ * Opens the connections of the capture (see chatcapture.h), sends their
+ * lines and closes them with the same timing, scaled by the speed factor,
+ * and reads everything the server sends back. Meanwhile a probe client
+ * sends VERSION and times the answer, for the latency of the server under
+ * that traffic.
+ *
+ * usage: ./chatreplay [-s speed] [-p probe_ms] [-u unix_socket_path] <capture> <host> <port>
+ *
+ *  -s speed: 2 plays twice as fast, 0.5 half as fast, 0 as fast as possible
+ *  -p probe_ms: time between probes, 0 for no probe (default 100)
+ *  -u: the connections that were local go to this unix domain socket
+ *
+ * The idle time before the first connection of the capture is skipped.
+ * The results are printed to stdout as JSON, like chatmicrobench, to
+ * compare the builds of the server:
+ *  - lag: how late the replayer sent the records, if it could not keep up
+ *  - refused_in_capture: connections the captured server shed, played
+ *    as a connect and a close right after
+ *  - closed_by_server: connections closed before their time, and not
+ *    after LEAVE (refused, busy, or failed)
+ *  - probe_lines_per_s: lines the server delivered to the probe, a
+ *    joined client as any other, per second; received_bytes_per_s the
+ *    same for all the connections
+ *  - latency_us: percentiles of the VERSION probes
+ */
+
+#define _GNU_SOURCE // for ppoll
+#include "nethelp.h"
+#include "chatcapture.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DEFAULT_PROBE_MS (100)
+#define REPLAY_BATCH (64)       // records played between two polls, at most
+#define PROBE_NAME "replay_probe"
+#define VERSION_REPLY "Chat Server v0.1\n"
+
+// a connection of the capture being played
+typedef struct {
+    int slot;       // position in the poll set, -1 if not open
+    bool left;      // it sent LEAVE, the server closes it
+} replay_conn_t;
+
+static replay_conn_t* conns = NULL;    // by number of the capture
+static uint32_t conns_size = 0;
+
+// poll set, slot 0 is the probe, and who is in every slot
+static struct pollfd* fds = NULL;
+static uint32_t* owners = NULL;
+static int nfds = 0, fds_size = 0;
+
+static struct sockaddr_storage tcp_address;
+static socklen_t tcp_address_len = 0;
+static struct sockaddr_un unix_address;
+
+typedef struct {
+    uint64_t connections;
+    uint64_t connect_failures;
+    uint64_t refused_in_capture;
+    uint64_t closed_by_server;
+    uint64_t lines;
+    uint64_t probe_lines;   // received by the probe
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t lag_max_ns;
+    uint64_t lag_sum_ns;
+    uint64_t records;
+    uint64_t* latencies_ns;
+    uint64_t probes;
+    uint64_t probes_size;
+} replay_stats_t;
+
+static replay_stats_t stats;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void printUsage(const char* program)
+{
+    fprintf(stderr, "usage: %s [-s speed] [-p probe_ms] [-u unix_socket_path] <capture> <host> <port>\n", program);
+    exit(EXIT_FAILURE);
+}
+
+static int resolve(const char* host, int port)
+{
+    struct addrinfo hints, *result;
+    char service[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &result) != 0) return -1;
+
+    memcpy(&tcp_address, result->ai_addr, result->ai_addrlen);
+    tcp_address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+// open a connection like the client of the capture did, -1 if it fails
+static int connect_to(bool local)
+{
+    bool unix_socket = local && unix_address.sun_family == AF_UNIX;
+    int family = unix_socket ? AF_UNIX : tcp_address.ss_family;
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int rv = unix_socket
+        ? connect(fd, (struct sockaddr*)&unix_address, sizeof(unix_address))
+        : connect(fd, (struct sockaddr*)&tcp_address, tcp_address_len);
+    if (rv < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void add_fd(int fd, uint32_t owner)
+{
+    if (nfds == fds_size) {
+        fds_size = fds_size ? fds_size * 2 : 64;
+        fds = realloc(fds, fds_size * sizeof(struct pollfd));
+        owners = realloc(owners, fds_size * sizeof(uint32_t));
+        if (fds == NULL || owners == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fds[nfds].fd = fd;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    owners[nfds] = owner;
+    if (owner != 0) { conns[owner].slot = nfds; }
+    nfds++;
+}
+
+// close the connection in the slot, the last one takes its place
+static void remove_slot(int slot)
+{
+    close(fds[slot].fd);
+    conns[owners[slot]].slot = -1;
+
+    nfds--;
+    if (slot != nfds) {
+        fds[slot] = fds[nfds];
+        owners[slot] = owners[nfds];
+        conns[owners[slot]].slot = slot;
+    }
+}
+
+static replay_conn_t* get_conn(uint32_t number)
+{
+    if (number >= conns_size) {
+        uint32_t size = conns_size ? conns_size : 1024;
+        while (size <= number) { size *= 2; }
+        conns = realloc(conns, size * sizeof(replay_conn_t));
+        if (conns == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = conns_size; i < size; i++) {
+            conns[i].slot = -1;
+            conns[i].left = false;
+        }
+        conns_size = size;
+    }
+    return &conns[number];
+}
+
+// play one record of the capture
+static void play(const capture_record_t* record, const char* data)
+{
+    replay_conn_t* conn = get_conn(record->conn);
+
+    switch (record->kind) {
+    case CAPTURE_OPEN: {
+        char flags = (record->len > 0) ? data[0] : 0;
+        if (flags & CAPTURE_REFUSED) { stats.refused_in_capture++; }
+        int fd = connect_to(flags & CAPTURE_LOCAL);
+        if (fd < 0) {
+            stats.connect_failures++;
+        } else {
+            stats.connections++;
+            add_fd(fd, record->conn);
+        }
+        break;
+    }
+    case CAPTURE_LINE: {
+        if (conn->slot < 0) break; // it failed, or the server closed it
+        int len = record->len;
+        if (sendall(fds[conn->slot].fd, (char*)data, &len, MSG_NOSIGNAL) < 0) {
+            stats.closed_by_server++;
+            remove_slot(conn->slot);
+            break;
+        }
+        stats.lines++;
+        stats.bytes_sent += record->len;
+        conn->left = (0 == strncmp(data, "LEAVE", strlen("LEAVE")));
+        break;
+    }
+    case CAPTURE_CLOSE:
+        if (conn->slot >= 0) { remove_slot(conn->slot); }
+        break;
+    default:
+        break;
+    }
+}
+
+// read the next record and its data, return false at the end of the file
+static bool next_record(FILE* capture, capture_record_t* record, char* data)
+{
+    if (fread(record, sizeof(*record), 1, capture) != 1) return false;
+    if (record->len > 0 && fread(data, record->len, 1, capture) != 1) return false;
+    return true;
+}
+
+/*
+ * the probe: one VERSION at a time, the answer is looked for in what
+ * it reads (it gets the chat traffic too, as any joined client)
+ */
+typedef struct {
+    bool waiting;
+    uint64_t sent_ns;
+    uint64_t next_ns;
+    uint64_t interval_ns;
+    linebuf_t input;
+} probe_t;
+
+static void probe_send(probe_t* probe, uint64_t now)
+{
+    if (probe->waiting || probe->interval_ns == 0 || now < probe->next_ns) return;
+
+    if (send(fds[0].fd, "VERSION\n", strlen("VERSION\n"), MSG_NOSIGNAL) < 0) {
+        probe->interval_ns = 0; // no more probes
+        return;
+    }
+    probe->waiting = true;
+    probe->sent_ns = now;
+    probe->next_ns = now + probe->interval_ns;
+}
+
+static void probe_read(probe_t* probe)
+{
+    char line[MAXLINE];
+
+    if (linebuf_fill(&probe->input, fds[0].fd) <= 0) {
+        fprintf(stderr, "the probe was closed by the server\n");
+        probe->interval_ns = 0;
+        fds[0].fd = -1;
+        return;
+    }
+    while (linebuf_getline(&probe->input, line, sizeof(line)) > 0) {
+        stats.probe_lines++;
+        if (!probe->waiting || strcmp(line, VERSION_REPLY) != 0) continue;
+
+        probe->waiting = false;
+        if (stats.probes == stats.probes_size) {
+            stats.probes_size = stats.probes_size ? stats.probes_size * 2 : 1024;
+            stats.latencies_ns = realloc(stats.latencies_ns, stats.probes_size * sizeof(uint64_t));
+            if (stats.latencies_ns == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        stats.latencies_ns[stats.probes++] = now_ns() - probe->sent_ns;
+    }
+}
+
+// read what the server sent to the connections
+static void read_connections(probe_t* probe)
+{
+    char buffer[65536];
+
+    if (fds[0].revents != 0) { probe_read(probe); }
+    for (int i = nfds - 1; i > 0; i--) {
+        if (fds[i].revents == 0) continue;
+
+        ssize_t n = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n > 0) {
+            stats.bytes_received += n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            if (!conns[owners[i]].left) { stats.closed_by_server++; }
+            remove_slot(i);
+        }
+    }
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+    if (stats.probes == 0) return 0;
+    uint64_t i = (uint64_t)(p * (stats.probes - 1) + 0.5);
+    return stats.latencies_ns[i] / 1000.0;
+}
+
+static void printResults(const char* path, double speed, uint64_t duration_ns)
+{
+    double seconds = duration_ns / 1e9;
+    qsort(stats.latencies_ns, stats.probes, sizeof(uint64_t), compare_u64);
+
+    printf("{\n");
+    printf("  \"capture\": \"%s\",\n", path);
+    printf("  \"speed\": %.2f,\n", speed);
+    printf("  \"duration_s\": %.3f,\n", seconds);
+    printf("  \"connections\": %llu,\n", (unsigned long long)stats.connections);
+    printf("  \"connect_failures\": %llu,\n", (unsigned long long)stats.connect_failures);
+    printf("  \"refused_in_capture\": %llu,\n", (unsigned long long)stats.refused_in_capture);
+    printf("  \"closed_by_server\": %llu,\n", (unsigned long long)stats.closed_by_server);
+    printf("  \"lines\": %llu,\n", (unsigned long long)stats.lines);
+    printf("  \"probe_lines_per_s\": %.1f,\n", seconds > 0 ? stats.probe_lines / seconds : 0);
+    printf("  \"bytes_sent\": %llu,\n", (unsigned long long)stats.bytes_sent);
+    printf("  \"bytes_received\": %llu,\n", (unsigned long long)stats.bytes_received);
+    printf("  \"received_bytes_per_s\": %.1f,\n", seconds > 0 ? stats.bytes_received / seconds : 0);
+    printf("  \"lag_max_ms\": %.3f,\n", stats.lag_max_ns / 1e6);
+    printf("  \"lag_avg_ms\": %.3f,\n", stats.records ? stats.lag_sum_ns / 1e6 / stats.records : 0);
+    printf("  \"probes\": %llu,\n", (unsigned long long)stats.probes);
+    printf("  \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}\n",
+           percentile_us(0.5), percentile_us(0.9), percentile_us(0.99), percentile_us(1.0));
+    printf("}\n");
+}
+
+int main(int argc, char** argv)
+{
+    double speed = 1.0;
+    long probe_ms = DEFAULT_PROBE_MS;
+    char* unix_path = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:p:u:")) != -1) {
+        if (option == 's') {
+            speed = atof(optarg);
+        } else if (option == 'p') {
+            probe_ms = atol(optarg);
+        } else if (option == 'u') {
+            unix_path = optarg;
+        } else {
+            printUsage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || speed < 0 || probe_ms < 0) {
+        printUsage(argv[0]);
+    }
+    char* path = argv[optind];
+
+    FILE* capture = fopen(path, "rb");
+    capture_header_t header;
+    if (capture == NULL || fread(&header, sizeof(header), 1, capture) != 1
+        || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "not a capture of chatserver: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (resolve(argv[optind + 1], atoi(argv[optind + 2])) < 0) {
+        fprintf(stderr, "unknown host name %s\n", argv[optind + 1]);
+        exit(EXIT_FAILURE);
+    }
+    if (unix_path != NULL) {
+        unix_address.sun_family = AF_UNIX;
+        strncpy(unix_address.sun_path, unix_path, sizeof(unix_address.sun_path) - 1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // the probe joins first, and takes the slot 0
+    probe_t probe;
+    memset(&probe, 0, sizeof(probe));
+    linebuf_init(&probe.input);
+    probe.interval_ns = (uint64_t)probe_ms * 1000000ULL;
+    get_conn(0);
+    int probefd = connect_to(false);
+    if (probefd < 0) {
+        fprintf(stderr, "Connection to the server failed\n");
+        exit(EXIT_FAILURE);
+    }
+    const char* join = "JOIN " PROBE_NAME "\n";
+    send(probefd, join, strlen(join), MSG_NOSIGNAL);
+    add_fd(probefd, 0);
+
+    capture_record_t record;
+    char data[UINT16_MAX + 1];
+    bool more = next_record(capture, &record, data);
+    uint64_t first_ns = more ? record.ns : 0;
+    uint64_t start = now_ns();
+
+    while (more) {
+        uint64_t now = now_ns();
+
+        // the records that are due, and the time to wait for the next one
+        uint64_t due = start;
+        for (int played = 0; more && played < REPLAY_BATCH; played++) {
+            due = start + ((speed > 0) ? (uint64_t)((record.ns - first_ns) / speed) : 0);
+            if (due > now) break;
+
+            stats.records++;
+            stats.lag_sum_ns += now - due;
+            if (now - due > stats.lag_max_ns) { stats.lag_max_ns = now - due; }
+            play(&record, data);
+            more = next_record(capture, &record, data);
+            now = now_ns();
+        }
+        probe_send(&probe, now);
+
+        uint64_t wake = more ? due : now;
+        if (probe.interval_ns > 0 && !probe.waiting && probe.next_ns < wake) { wake = probe.next_ns; }
+        struct timespec timeout = { 0, 0 };
+        if (wake > now) {
+            timeout.tv_sec = (wake - now) / 1000000000ULL;
+            timeout.tv_nsec = (wake - now) % 1000000000ULL;
+        }
+        if (ppoll(fds, nfds, &timeout, NULL) < 0 && errno != EINTR) {
+            reportErrno();
+            exit(EXIT_FAILURE);
+        }
+        read_connections(&probe);
+    }
+    uint64_t duration = now_ns() - start;
+
+    // the answer of the last probe, if any
+    if (probe.waiting && fds[0].fd >= 0) {
+        uint64_t deadline = now_ns() + 1000000000ULL;
+        while (probe.waiting && fds[0].fd >= 0 && now_ns() < deadline) {
+            if (poll(fds, 1, 100) > 0) { probe_read(&probe); }
+        }
+    }
+
+    printResults(path, speed, duration);
+    fclose(capture);
+    return EXIT_SUCCESS;
+}
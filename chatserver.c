@@ -3,20 +3,36 @@
  * Communication protocol
  *     JOIN name
  *     WHO
+ *     DM name message
  *     LEAVE
  *
  *     reference: http://www.csc.villanova.edu/~mdamian/classes/csc2405sp18/sockets/chat
  */
 
 #include "nethelp.h"
+#include "chatproto.h"
+#include "chatqueue.h"
+#include "chatfed.h"
+#include "chattransport.h"
+#include "chatfanout.h"
+#include "chaturing.h"
+#include "chatadmit.h"
+#include "chattrace.h"
+#include "chatzip.h"
+#include "chatcapture.h"
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <semaphore.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
 
-#define MAX_CLIENTS (20)
+#ifndef MAX_CLIENTS // slots of the array of clients, make CPPFLAGS=-DMAX_CLIENTS=n
+#define MAX_CLIENTS (1024)
+#endif
 #define MAX_NAME_LENGTH (20)
 #define DEBUG_ON (1)
 #define DEBUG if(DEBUG_ON)
@@ -28,13 +44,20 @@ typedef struct
 {
     int fd;
     char* name;
+    outqueue_t* queue; // outbound frames, with control and bulk lanes
+    bool local;        // accepted on the unix domain socket
+    bool ring;         // served by the io_uring loop, that closes the socket
+    bool link;         // federation link, not a client that has to JOIN
+    peer_addr_t peer;  // IP address, for the limit of connections per IP
+    uint32_t capture;  // number of the connection in the capture, 0 if none
 } client_info;
 
 client_info clients[MAX_CLIENTS]; // slot i is empty, is clients[i]= NULL
 sem_t mutex; // semaphore to protect critical sections
+int joined_clients = 0; // clients with a name, under mutex
 
 // TODO: the array of clients, is fine, but it is basic, maybe a C hash map could be implemented
-// TODO: add the command for 'direct message' and 'send file' 
+// TODO: add the command for 'send file'
 
 // prototypes:
 
@@ -44,45 +67,144 @@ void* HandleClient(void* arg);
 // add client name in position index in the array 'clients'
 void HandleJOIN(char* buf, int index);
 
-// write the names of all active clients over the connection fd
-void HandleWHO(int fd);
+// send the names of all active clients to the client in position index
+void HandleWHO(int index);
 
 // remove the client from position index in the array 'clients'
 void HandleLEAVE(int index);
 
+// allocate an entry in the array 'clients' and a thread for a new connection
+void AcceptClient(int connfd, bool local);
+
+// allocate an entry in the array 'clients' if the limits allow it,
+// otherwise reply busy and return -1
+static int ReserveSlot(int connfd, bool local, outqueue_t* queue);
+
+// the client in position index is a federation link
+static void MarkLink(int index);
+
+// handle a line of the client in position index, return its command
+static command_t DispatchLine(char* buf, int index);
+
 // broadcast message from client in position index to all active clients
 void HandleBroadcast(char* msg, int index);
 
-// send version of the server
-void HandleVERSION(int fd);
+// send version of the server to the client in position index
+void HandleVERSION(int index);
+
+// send a direct message from the client in position index to another client
+void HandleDM(char* buf, int index);
+
+// set the compression of the messages sent to the client in position index
+void HandleCOMPRESS(char* buf, int index);
+
+// queue a frame in the bulk lane of all the joined clients but 'except'
+void SendToAll(frame_t* frame, int except);
 
-// check WHO command
-bool checkWHO(char* message);
+// release the slot index in the array 'clients' and close its connection
+void RemoveClient(int index, bool flush);
 
-// check JOIN command
-bool checkJOIN(char* message);
+// parse the scheduling options of the outbound queues
+static int parseQueueOption(int option, const char* value);
 
-// check LEAVE command
-bool checkLEAVE(char* message);
+// calls from the federation to reach the local clients
+static void DeliverBroadcast(const char* from, const char* text);
+static void DeliverNotice(const char* text);
+static bool DeliverDM(const char* from, const char* to, const char* text);
+static void ForEachLocalClient(void (*fn)(const char* name, void* arg), void* arg);
 
-// check VERSION command
-bool checkVERSION(char* message);
+static const fed_hooks_t federation_hooks = {
+    .deliver_broadcast = DeliverBroadcast,
+    .deliver_notice = DeliverNotice,
+    .deliver_dm = DeliverDM,
+    .for_each_local = ForEachLocalClient,
+};
+
+// calls from the io_uring backend
+static int RingAccepted(int fd, outqueue_t* queue);
+static uring_action_t RingLine(int index, char* line);
+static void RingClosed(int index);
+static void RingHandoff(int index, const char* first, linebuf_t* input);
+static void* RingThread(void* arg);
+
+static const uring_hooks_t ring_hooks = {
+    .accepted = RingAccepted,
+    .line = RingLine,
+    .closed = RingClosed,
+    .handoff = RingHandoff,
+};
 
 int main(int argc, char** argv) {
   int listenfd, port;
-  struct sockaddr clientaddr;
-  int clientlen = sizeof(struct sockaddr);
+  int unixfd = -1;            // listening unix domain socket, for local clients
+  char* unix_path = NULL;
   int connfd; // connfd: connection file descriptor
-  int tid;    // thread id
 
-  if (argc != 2) {
-      fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  unsigned int node_id = 0;   // federation node id, 0: not federated
+  char* peer_list[MAX_PEERS];  // federation peers, host:port
+  int peer_count = 0;
+  bool use_ring = false;      // io_uring backend for the TCP clients
+  char* capture_path = NULL;  // record the traffic of the clients there
+  char* fed_secret = NULL;    // shared by the federated nodes
+
+  // the thread of the sender delivers too, so one worker less than cores
+  fanout_config.workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+  int option;
+  // all the slots, a third of them waiting for JOIN and no limit per IP
+  admission_config.max_connections = MAX_CLIENTS;
+  admission_config.max_unjoined = MAX_CLIENTS / 3;
+
+  while ((option = getopt(argc, argv, "q:w:b:s:n:p:u:f:t:B:c:i:j:T:z:C:k:")) != -1) {
+      if (option == 'k') {
+          fed_secret = optarg;
+      } else if (option == 'C') {
+          capture_path = optarg;
+      } else if (option == 'z') {
+          zip_threshold = strtoul(optarg, NULL, 10);
+      } else if (option == 'T') {
+          trace_sample_rate = strtoul(optarg, NULL, 10);
+      } else if (option == 'c') {
+          admission_config.max_connections = atoi(optarg);
+      } else if (option == 'i') {
+          admission_config.max_per_ip = atoi(optarg);
+      } else if (option == 'j') {
+          admission_config.max_unjoined = atoi(optarg);
+      } else if (option == 'B') {
+          use_ring = (0 == strcmp(optarg, "uring"));
+          if (!use_ring && 0 != strcmp(optarg, "threads")) {
+              fprintf(stderr, "unknown backend: %s\n", optarg);
+              argc = 0; // print the usage and exit
+              break;
+          }
+      } else if (option == 'f') {
+          fanout_config.workers = atoi(optarg);
+      } else if (option == 't') {
+          fanout_config.threshold = atoi(optarg);
+      } else if (option == 'u') {
+          unix_path = optarg;
+      } else if (option == 'n') {
+          node_id = strtoul(optarg, NULL, 10);
+      } else if (option == 'p' && peer_count < MAX_PEERS) {
+          peer_list[peer_count++] = optarg;
+      } else if (parseQueueOption(option, optarg) < 0) {
+          argc = 0; // print the usage and exit
+          break;
+      }
+  }
+
+  if (argc - optind != 1) {
+      fprintf(stderr, "usage: %s [-q strict|weighted] [-w control_weight] [-b bulk_limit_bytes] [-s sndbuf_bytes]\n"
+                      "          [-f fanout_workers] [-t fanout_threshold] [-B threads|uring]\n"
+                      "          [-c max_connections] [-i max_per_ip] [-j max_unjoined] [-T trace_sample_rate]\n"
+                      "          [-z compression_threshold] [-C capture_file]\n"
+                      "          [-n node_id -k secret [-p peer_host:peer_port]...] [-u unix_socket_path] <port>\n", argv[0]);
       // argv[0] is the name of the program by convention
       exit(EXIT_FAILURE);
   }
 
   // get the port number on which to lsiten for incomming request from clients
-  port = atoi(argv[1]);
+  port = atoi(argv[optind]);
   // TODO: atoi is not the safest function to parse integers, as it doesn't handle errors. 'strol' may be better.
 
   // initialize array of clients
@@ -90,13 +212,47 @@ int main(int argc, char** argv) {
   {
       clients[i].name = NULL;
       clients[i].fd = -1;
+      clients[i].queue = NULL;
+      clients[i].local = false;
+      clients[i].ring = false;
+      clients[i].link = false;
+      clients[i].capture = 0;
   }
 
+  // a client that disconnects must not kill the server when we write to it
+  signal(SIGPIPE, SIG_IGN);
+
   printf("%s\n", VERSION);
 
   // initialize semaphore to protect critical sections.
   sem_init(&mutex, 0, 1);
 
+  // both handle signals in a thread of their own, before any other
+  // thread is created: SIGINT/SIGTERM write the rest of the capture,
+  // SIGUSR1 prints the trace buffer
+  if (capture_path != NULL && capture_open(capture_path) < 0) {
+      printf("Failed to open the capture file %s\n", capture_path);
+      exit(EXIT_FAILURE);
+  }
+
+  if (trace_init() < 0) {
+      printf("Failed to start the tracing\n");
+      exit(EXIT_FAILURE);
+  }
+
+  // workers for the broadcasts to large rooms
+  if (fanout_config.workers < 0) { fanout_config.workers = 0; }
+  if (fanout_init() < 0) {
+      printf("Failed to start the fan-out workers\n");
+      exit(EXIT_FAILURE);
+  }
+
+  // keep a descriptor to shed connections when they run out
+  if (admission_init() < 0) {
+      printf("Failed to reserve the spare descriptor\n");
+      exit(EXIT_FAILURE);
+  }
+
   // create a listening socket
   listenfd = open_listenfd(port);
   if (listenfd < 0) {
@@ -104,38 +260,80 @@ int main(int argc, char** argv) {
       exit(EXIT_FAILURE);
   }
 
+  // accept() must not block when another thread took the connection
+  fcntl(listenfd, F_SETFL, O_NONBLOCK);
+
+  // local clients may also connect on a unix domain socket, with
+  // plain sockets or with a shared memory channel
+  if (unix_path != NULL) {
+      unixfd = open_unix_listenfd(unix_path);
+      if (unixfd < 0) {
+          printf("Failed to open listening unix socket %s\n", unix_path);
+          reportErrno();
+          exit(EXIT_FAILURE);
+      }
+      fcntl(unixfd, F_SETFL, O_NONBLOCK);
+  }
+
+  // join the federation, the links to the peers are kept by their own threads
+  if (node_id != 0) {
+      if (fed_init(node_id, fed_secret, &federation_hooks) < 0) {
+          exit(EXIT_FAILURE);
+      }
+      for (int i = 0; i < peer_count; i++) {
+          if (fed_add_peer(peer_list[i]) < 0) {
+              exit(EXIT_FAILURE);
+          }
+      }
+  } else if (peer_count > 0) {
+      fprintf(stderr, "a node id (-n) is needed to use peers\n");
+      exit(EXIT_FAILURE);
+  }
+
   char hostname[MAX_HOSTNAME_SIZE];
   gethostname(hostname, MAX_HOSTNAME_SIZE);
   fprintf(stdout, "Server ready! host: %s, port: %d\n", hostname, port);
+  if (node_id != 0) {
+      fprintf(stdout, "federation node %u, %d peers\n", node_id, peer_count);
+  }
+  if (unixfd >= 0) {
+      fprintf(stdout, "local clients on unix socket: %s\n", unix_path);
+  }
+
+  // wait for connections on the TCP and on the unix domain sockets
+  struct pollfd listeners[2] = {
+      { .fd = listenfd, .events = POLLIN },
+      { .fd = unixfd, .events = POLLIN },  // ignored by poll() if -1
+  };
+
+  // with io_uring, a thread serves all the TCP clients. The local clients
+  // stay with the threads (shared memory channels need SCM_RIGHTS)
+  if (use_ring) {
+      pthread_t tid;
+      if (uring_init(listenfd, &ring_hooks) == 0 && pthread_create(&tid, NULL, RingThread, NULL) == 0) {
+          fprintf(stdout, "TCP clients served by io_uring\n");
+          listeners[0].fd = -1;
+      } else {
+          fprintf(stdout, "falling back to the threaded backend\n");
+      }
+  }
 
   while (1) {
-      // Accept an incomming request from a client
-      connfd = accept(listenfd, (struct sockaddr*)&clientaddr, &clientlen); // connfd : connection file descriptor
-      if (connfd < 0) { continue; } // connection failed
-
-      // Allocate a new entry in the array of clients for the new client
-      // create a new thread to handle the client
-      // 'clients' may be modified by other threads, so it has to be protected with a semaphore
-	  // This threaded design actually is lacking against the C10K problem (https://www.youtube.com/watch?v=L0jMBrCEQNQ)
-
-      sem_wait(&mutex);
-      fprintf(stdout, "accepted new connection\n");
-      for (int i = 0; i < MAX_CLIENTS; i++)
-      {
-          if (clients[i].fd < 0) // find empty slot
-          {
-              clients[i].fd = connfd;
-              pthread_create(&tid,         // pointer to pthread descriptor
-                             NULL,         // use default atributes
-                             HandleClient, // thread function entry point 
-                             (void*)i      // parameters to passs to the thread function 
-                            );
-               break;
+      if (poll(listeners, 2, -1) < 0) { continue; }
+
+      for (int l = 0; l < 2; l++) {
+          if (!(listeners[l].revents & POLLIN)) { continue; }
+
+          // Accept an incomming request from a client
+          connfd = accept(listeners[l].fd, NULL, NULL); // connfd : connection file descriptor
+          if (connfd < 0 && (errno == EMFILE || errno == ENFILE)
+              && admission_accept_spare(listeners[l].fd, (listeners[l].fd == unixfd)) < 0) {
+              usleep(ADMISSION_BACKOFF_MS * 1000); // no spare descriptor either
           }
-      }
-      printf("thread launched with id: %d\n", tid);  // TODO: clean?
-      sem_post(&mutex);
+          if (connfd < 0) { continue; } // connection failed
 
+          AcceptClient(connfd, (listeners[l].fd == unixfd));
+      }
   } // end while(1)
 
   //TODO: it would be nice to add a routine that every now and then removes
@@ -144,78 +342,258 @@ int main(int argc, char** argv) {
   return EXIT_SUCCESS;
 }
 
+/*
+* ReserveSlot - allocate a new entry in the array of clients for the
+* connection connfd. queue is NULL for the threaded backend, that
+* creates it later
+*/
+static int ReserveSlot(int connfd, bool local, outqueue_t* queue)
+{
+    int index = -1;
+    int connections = 0, unjoined = 0, same_peer = 0;
+    shed_reason_t reason = SHED_REASONS;
+    peer_addr_t peer;
+
+    if (local) {
+        memset(&peer, 0, sizeof(peer)); // no limit per IP for the local clients
+    } else {
+        admission_peer(connfd, &peer);
+    }
+
+    // 'clients' may be modified by other threads, so it has to be protected with a semaphore
+    sem_wait(&mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (clients[i].fd < 0) { // find empty slot
+            if (index < 0) { index = i; }
+            continue;
+        }
+        connections++;
+        if ((clients[i].name == NULL) && !clients[i].link) { unjoined++; }
+        if (admission_same_peer(&peer, &clients[i].peer)) { same_peer++; }
+    }
+
+    if ((index < 0) || (admission_config.max_connections > 0 && connections >= admission_config.max_connections)) {
+        reason = SHED_FULL;
+    } else if (admission_config.max_per_ip > 0 && same_peer >= admission_config.max_per_ip) {
+        reason = SHED_PER_IP;
+    } else if (admission_config.max_unjoined > 0 && unjoined >= admission_config.max_unjoined) {
+        reason = SHED_UNJOINED;
+    } else {
+        clients[index].fd = connfd;
+        clients[index].local = local;
+        clients[index].queue = queue;
+        clients[index].ring = (queue != NULL);
+        clients[index].link = false;
+        clients[index].peer = peer;
+        clients[index].capture = capture_connect(local, false);
+    }
+    sem_post(&mutex);
+
+    if (reason != SHED_REASONS) {
+        // in the capture too, a replay must knock on the door as often
+        uint32_t capture = capture_connect(local, true);
+        admission_shed(connfd, reason);
+        capture_close(capture);
+        return -1;
+    }
+    fprintf(stdout, "accepted new %s connection\n", local ? "local" : "TCP");
+    return index;
+}
+
+static void MarkLink(int index)
+{
+    sem_wait(&mutex);
+    clients[index].link = true;
+    // the traffic of the federation is not captured, the client is gone
+    capture_close(clients[index].capture);
+    clients[index].capture = 0;
+    sem_post(&mutex);
+}
+
+/*
+* AcceptClient - allocate a new entry in the array of clients for the
+* new client and create a new thread to handle it
+*/
+void AcceptClient(int connfd, bool local)
+{
+    pthread_t tid; // thread id
+
+    // This threaded design actually is lacking against the C10K problem (https://www.youtube.com/watch?v=L0jMBrCEQNQ)
+    // (the io_uring backend is the answer)
+    int index = ReserveSlot(connfd, local, NULL);
+    if (index < 0) {
+        close(connfd); // refused, the busy reply is already sent
+        return;
+    }
+
+    if (pthread_create(&tid,         // pointer to pthread descriptor
+                       NULL,         // use default atributes
+                       HandleClient, // thread function entry point
+                       (void*)(long)index // parameters to passs to the thread function
+                      ) != 0) {
+        fprintf(stderr, "failed to create the thread of the client\n");
+        RemoveClient(index, false);
+        return;
+    }
+    printf("thread launched with id: %lu\n", (unsigned long)tid);  // TODO: clean?
+}
+
 /*
 * HandleClient - handle chat client
 * arg is the client index in the client's array
 */
 void* HandleClient(void* arg)
 {
-  size_t n = 1;
+  int n = 1;
   char buf[MAXLINE];  // TODO: maybe a better name for this variable would be 'message' or 'input_message'.
+  bool left = false;  // the client used LEAVE, and it is already removed
 
-  int index = (int)arg;
+  int index = (int)(long)arg;
   int connfd = clients[index].fd;
 
   // Detach the thread to free memory resources upon termination
   pthread_detach(pthread_self());
 
+  // the lines of the client are read in blocks, not one byte per read()
+  transport_t transport;
+  linebuf_t input;
+  transport_init_socket(&transport, connfd);
+  linebuf_init(&input);
+
+  // a local client may start a shared memory channel with its first message
+  if (clients[index].local && transport_accept_local(&transport, &input) <= 0) {
+      RemoveClient(index, false);
+      return NULL;
+  }
+
+  // all the output to this client goes through its queue and writer thread
+  outqueue_t* queue = outqueue_create_transport(&transport);
+  if (queue == NULL) {
+      fprintf(stderr, "Error creating the output queue of the client\n");
+      RemoveClient(index, false);
+      transport_release(&transport);
+      return NULL;
+  }
+  sem_wait(&mutex);
+  clients[index].queue = queue;
+  sem_post(&mutex);
+
   while(n > 0) {
 	  // process commands JOIN, WHO, LEAVE
 	  // broadcast anything else
 
-	  // TODO: add your code here
-
 	  // read the next line from the client
-	  n = readline(connfd, buf, MAXLINE);
-
-	  fprintf(stdout, "[%s] %s\n",(clients[index].name? clients[index].name : "?"), buf);
-
-	  // TODO: if this if-esle-if clause would be a function, it would be easier to test
-	  if (clients[index].name == NULL) {
-	      if (checkJOIN(buf)) {
-		  HandleJOIN(buf, index);
-	      }
-	  } else if (checkWHO(buf)) {
-	     HandleWHO(connfd);
-	  } else if (checkLEAVE(buf)) {
-	     HandleLEAVE(index);
-	  } else if (checkVERSION(buf)) {
-             HandleVERSION(connfd);
-	  } else {
-	     HandleBroadcast(buf, index);
+	  n = linebuf_getline(&input, buf, MAXLINE);
+	  if (n == 0) {
+	      n = transport_fill(&transport, &input, false);
+	      continue; // connection closed or failed if n <= 0
+	  }
+
+	  trace_begin(connfd, n);
+	  command_t command = DispatchLine(buf, index);
+	  trace_end();
+
+	  switch (command) {
+	  case CMD_LEAVE:
+	     left = true;
+	     n = 0;
+	     break;
+	  case CMD_PEER:
+	     // another server: the connection becomes a federation link
+	     MarkLink(index);
+	     fed_serve_link(&transport, queue, &input, buf);
+	     n = 0;
+	     break;
+	  default:
+	     break;
 	  }
   }
 
   // close connection with the client
-  close(connfd);
+  if (!left) {
+      RemoveClient(index, false);
+  }
+  transport_release(&transport);
   return NULL;
 }
 
+/*
+* DispatchLine - handle a line of the client in position index, the
+* same for all the backends. A PEER line is only classified: the
+* caller turns the connection into a federation link
+*/
+static command_t DispatchLine(char* line, int index)
+{
+  char* buf = trace_parse_prefix(line);
+  command_t command = parseCommand(buf, clients[index].name != NULL);
+  trace_parsed(clients[index].fd, command);
+
+  // a PEER line has the secret of the federation, never log it
+  if (command != CMD_PEER) {
+      fprintf(stdout, "[%s] %s\n",(clients[index].name? clients[index].name : "?"), line);
+
+      // as received, the TRACE prefix included
+      if (clients[index].capture != 0) {
+          capture_line(clients[index].capture, line, strlen(line));
+      }
+  }
+  switch (command) {
+  case CMD_JOIN:
+     HandleJOIN(buf, index);
+     break;
+  case CMD_WHO:
+     HandleWHO(index);
+     break;
+  case CMD_LEAVE:
+     HandleLEAVE(index);
+     break;
+  case CMD_VERSION:
+     HandleVERSION(index);
+     break;
+  case CMD_DM:
+     HandleDM(buf, index);
+     break;
+  case CMD_COMPRESS:
+     HandleCOMPRESS(buf, index);
+     break;
+  case CMD_BROADCAST:
+     HandleBroadcast(buf, index);
+     break;
+  default:
+     break;
+  }
+  return command;
+}
+
 /* HandleWHO: send out client names in response to the WHO command
+*  the names are sent in a single frame in the control lane, so the
+*  answer does not wait behind the chat traffic queued for the client
 */
-void HandleWHO(int fd)
+void HandleWHO(int index)
 {
-  // TODO: add your code here
+  char output[MAXLINE];
+  size_t length = 0;
+
+  sem_wait(&mutex);
   for (int i = 0; i < MAX_CLIENTS; i++)  {
 
       if ((clients[i].name == NULL) || (clients[i].fd == -1))
           continue;
 
-      errno = 0;
-      ssize_t message_length = 0;
-
-      message_length = write(fd, clients[i].name, (strlen(clients[i].name /*+ 1*/)));
-      write(fd, "\n", sizeof(char));
+      int n = snprintf(output + length, sizeof(output) - length, "%s\n", clients[i].name);
+      if (n < 0 || (size_t)n >= sizeof(output) - length) { break; } // no more room
+      length += n;
       fprintf(stdout, "%s\n", clients[i].name);
+  }
+  sem_post(&mutex);
 
-      if (message_length == -1) {
-          // errno is set to error
-          fprintf(stderr, "Error when sending the WHO message\n");
-          fprintf(stdout, "Error when sending the WHO message\n");
-          fprintf(stderr, "client: %s, with file descriptor: %d\n", clients[i].name, clients[i].fd);
-          fprintf(stdout, "client: %s, with file descriptor: %d\n", clients[i].name, clients[i].fd);
-          reportErrno();
-      }
+  // and the clients of the other federated servers
+  length += fed_append_roster(output + length, sizeof(output) - length);
+
+  if (outqueue_send(clients[index].queue, LANE_CONTROL, output, length) < 0) {
+      fprintf(stderr, "Error when sending the WHO message\n");
+      fprintf(stderr, "client: %s, with file descriptor: %d\n", clients[index].name, clients[index].fd);
   }
   printf("\n");
 }
@@ -236,32 +614,24 @@ void HandleBroadcast(char* msg, int index)
     if (*msg == NULL)
 	return;
 
-    char message[MAX_MESSAGE_SIZE];
-    memset(message,0x00,sizeof(char)*MAX_MESSAGE_SIZE);
-
-    for (int i = 0; i < MAX_CLIENTS; i++) // go through all the clients
-    {
-        if ((i != index) && (clients[i].name != NULL) && (clients[i].fd != -1)) {
-            errno = 0;
-            ssize_t message_lenght = 0;
-
-            memset(message, 0x00, sizeof(char)*MAX_MESSAGE_SIZE);
-	    strcat(message, "[");
-	    strcat(message, clients[index].name);
-	    strcat(message, "] ");
-	    strcat(message, msg);
-
-	    ssize_t rv = send(clients[i].fd, message, strlen(message),0);
-
-	    if (rv == -1) {
-		// errno is set to error
-		fprintf(stderr, "Error when sending broadcast message\n");
-		fprintf(stderr, "client: %s, with file descriptor: %d\n", clients[i].name, clients[i].fd);
-		reportErrno();
-	    }
-        }
+    // the frame is the same for every recipient, so build it only once
+    // and share it between the queues of all of them
+    char message[MAXLINE];
+    int message_length = trace_echo(message, sizeof(message)); // only for traced messages
+    message_length += formatBroadcast(message + message_length, sizeof(message) - message_length,
+                                      clients[index].name, msg);
+    frame_t* frame = frame_new(message, message_length);
+    if (frame == NULL) {
+        fprintf(stderr, "Error allocating the broadcast message\n");
+        return;
     }
 
+    SendToAll(frame, index);
+    frame_unref(frame);
+
+    // and to the clients of the other federated servers
+    fed_publish_broadcast(clients[index].name, msg);
+
     //TODO: here it would be a good place in case we want record the chat
     //in a database such redis
 }
@@ -269,6 +639,21 @@ void HandleBroadcast(char* msg, int index)
 /* HandleJOIN: Add client name in position index in the
 *  array of clients
 */
+/* ValidName: 1 to MAX_NAME_LENGTH bytes, none of them a control
+ * character (UTF-8 is fine)
+ */
+static bool ValidName(const char* name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_NAME_LENGTH) return false;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (c < 0x20 || c == 0x7f) return false;
+    }
+    return true;
+}
+
 void HandleJOIN(char* buf, int index)
 {
     if (index >= MAX_CLIENTS) return;
@@ -278,9 +663,9 @@ void HandleJOIN(char* buf, int index)
 
     // Make sure that client did not already join
     if (clients[index].name != NULL) {
-        sprintf(buf, "Already joined as %s\n", clients[index].name);
+        sprintf(output, "Already joined as %s\n", clients[index].name);
 	fprintf(stdout, "you %s have already joined\n", clients[index].name);
-       	send(clients[index].fd, output, strlen(buf),0);
+	outqueue_send(clients[index].queue, LANE_CONTROL, output, strlen(output));
         return;
     }
 
@@ -289,35 +674,39 @@ void HandleJOIN(char* buf, int index)
     // skip all leading whitespaces
     while((*p_name == ' ') || (*p_name == '\t')) { p_name++; }
 
-    // TODO: check the max lenght of the name
-
     // replace '\n' by '\0' in user name if any
-    if ('\n' == p_name[strlen(p_name)-1]) {
-        p_name[strlen(p_name)-1] = '\0';
+    p_name[strcspn(p_name, "\r\n")] = '\0';
+
+    // the name starts the lines of the others (notices, WHO): it must be
+    // short and printable, so it can not pass for a line of the server
+    if (!ValidName(p_name)) {
+        sprintf(output, "Invalid name: 1 to %d characters, no control characters\n", MAX_NAME_LENGTH);
+        outqueue_send(clients[index].queue, LANE_CONTROL, output, strlen(output));
+        return;
     }
 
     sem_wait(&mutex); // we have to block here, in case several clients want to subscribe at the same time
 
     clients[index].name = malloc(strlen(p_name)+1); // +1 to account for '\0'
     strcpy(clients[index].name, p_name); // is better to use, strncpy. it is safer. It could be possible to also use strdup().
+    joined_clients++;
+
+    // the welcome is the acknowledgement of the command: control lane
+    sprintf(output, "Welcome to the chat room, %s!\n", p_name);
+    fprintf(stdout, "Welcome to the chat room, %s!\n\n", p_name);
+    if (outqueue_send(clients[index].queue, LANE_CONTROL, output, strlen(output)) < 0)
+        printf("Error when sending a message to the client\n");
 
     sem_post(&mutex); // release the lock
 
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-        if (clients[i].name == NULL) { continue; }
-	if (i == index) {
-	    sprintf(output, "Welcome to the chat room, %s!\n", p_name);
-	    fprintf(stdout, "Welcome to the chat room, %s!\n\n", p_name);
-	} else {
-	    sprintf(output, "%s has joined the chat room\n", p_name);
-	    //fprintf(stdout, "%s has joined the chat room\n", p_name);
-       	}
-
-        ssize_t rv = send(clients[i].fd, output, strlen(output), 0);
-	if (rv == -1)
-            printf("Error when sending a message to the client\n");
+    // the notice for the rest of the clients is chat traffic: bulk lane
+    sprintf(output, "%s has joined the chat room\n", p_name);
+    frame_t* frame = frame_new(output, strlen(output));
+    if (frame != NULL) {
+        SendToAll(frame, index);
+        frame_unref(frame);
     }
+    fed_publish_join(p_name);
 }
 
 /* HandleLEAVE: Remove client form position index in array clients
@@ -338,58 +727,299 @@ void HandleLEAVE(int index)
     // broadcast that someone leaves the chat.
     HandleBroadcast(buf, index);
 
+    // the frames already queued for the client are still delivered
+    RemoveClient(index, true);
+}
+
+/* RemoveClient: release the slot index of the array clients,
+ * stop its output queue and close the connection.
+ * with flush, the frames queued for the client are sent first.
+ */
+void RemoveClient(int index, bool flush)
+{
     sem_wait(&mutex);
     if (clients[index].name != NULL) {
 	printf("%s just leaved the chat room.\n\n", clients[index].name);
+        fed_publish_leave(clients[index].name);
         free(clients[index].name);  // free memory
        	clients[index].name = NULL; // clean up the name
+        joined_clients--;
     }
-    close(clients[index].fd);       // close the socket
-    clients[index].fd = -1;         // clean up the file descriptor
+    // once out of the array, nobody else can queue frames for the client
+    outqueue_t* queue = clients[index].queue;
+    clients[index].queue = NULL;
     sem_post(&mutex);
 
-    // Terminate the thread
-    pthread_exit(NULL);
+    outqueue_destroy(queue, flush);
+
+    sem_wait(&mutex);
+    if (!clients[index].ring) {
+        close(clients[index].fd);   // close the socket, the io_uring loop does it for its own
+    }
+    clients[index].fd = -1;         // clean up the file descriptor
+    clients[index].ring = false;
+    clients[index].link = false;
+    capture_close(clients[index].capture);
+    clients[index].capture = 0;
+    sem_post(&mutex);
 }
 
-void HandleVERSION(int fd) {
+void HandleVERSION(int index) {
    printf("%s", VERSION);
-   send(fd, VERSION, strlen(VERSION),0);
+   outqueue_send(clients[index].queue, LANE_CONTROL, VERSION, strlen(VERSION));
 }
 
-static char* removeLeadingSpaces(char* message) {
-    if (*message == NULL) return NULL;
+/* HandleCOMPRESS: "COMPRESS class", the messages of at least
+ * zip_threshold bytes sent to the client after the answer are
+ * compressed with the class, see chatzip.h.
+ */
+void HandleCOMPRESS(char* buf, int index)
+{
+    char output[MAX_MESSAGE_SIZE];
+    char* p_class = buf + strlen("COMPRESS");
+
+    while ((*p_class == ' ') || (*p_class == '\t')) { p_class++; }
+    p_class[strcspn(p_class, " \t\r\n")] = '\0';
+
+    int zclass = zip_class_parse(p_class);
+    if (zclass < 0) {
+        snprintf(output, sizeof(output), "usage: COMPRESS none|plain|chat\n");
+    } else {
+        snprintf(output, sizeof(output), "Compression: %s, messages of %zu bytes or more\n",
+                 zip_class_name(zclass), zip_threshold);
+    }
+    if (zclass >= 0) {
+        outqueue_send_compression(clients[index].queue, output, strlen(output), zclass);
+    } else {
+        outqueue_send(clients[index].queue, LANE_CONTROL, output, strlen(output));
+    }
+}
 
-    char* pstring = message;
-    // skip all leading whitespaces
-    while((*pstring == ' ') || (*pstring == '\t')) { pstring++; }
-    return *pstring;
+typedef struct {
+    frame_t* frame;
+    int except;
+} broadcast_t;
+
+// queue the broadcast for the slots [first, last), called with mutex held
+static void SendToRange(int first, int last, void* arg)
+{
+    broadcast_t* broadcast = arg;
+    for (int i = first; i < last; i++)
+    {
+        if ((i != broadcast->except) && (clients[i].name != NULL) && (clients[i].fd != -1)) {
+            outqueue_push(clients[i].queue, LANE_BULK, broadcast->frame);
+        }
+    }
 }
 
-static bool checkCommand(const char* command, char* message) {
-    if (*command == NULL) return false;
-    if (*message == NULL) return false;
+/*
+ * SendToAll: queue a frame for all the joined clients but except (-1 for
+ * none). Queuing never blocks, a slow client only loses its own bulk frames
+ * Large rooms are delivered by the fan-out workers, mutex stays held until
+ * all of them are done, so every client gets the broadcasts in one order.
+ */
+void SendToAll(frame_t* frame, int except)
+{
+    broadcast_t broadcast = { frame, except };
 
-    if (0 == strncmp(message, command, strlen(command)) ) {
-	return true;
+    sem_wait(&mutex);
+    fanout_run(MAX_CLIENTS, joined_clients, SendToRange, &broadcast);
+    sem_post(&mutex);
+}
+
+/* HandleDM: send "DM name message" to the client 'name', that
+ * may be connected to this server or to a federated one
+ */
+void HandleDM(char* buf, int index)
+{
+    char output[MAXLINE];
+    char* p_name = buf + strlen("DM");
+
+    // skip all leading whitespaces, the name ends at the next one
+    while ((*p_name == ' ') || (*p_name == '\t')) { p_name++; }
+    char* p_text = p_name;
+    while ((*p_text != '\0') && (*p_text != ' ') && (*p_text != '\t') && (*p_text != '\n')) { p_text++; }
+    if (*p_text != '\0') { *p_text++ = '\0'; }
+    while ((*p_text == ' ') || (*p_text == '\t')) { p_text++; }
+
+    if (*p_name == '\0' || *p_text == '\0' || *p_text == '\n') {
+        sprintf(output, "usage: DM name message\n");
+    } else if (DeliverDM(clients[index].name, p_name, p_text)) {
+        return;
+    } else if (fed_has_user(p_name)) {
+        fed_publish_dm(clients[index].name, p_name, p_text);
+        return;
+    } else {
+        snprintf(output, sizeof(output), "No such user: %s\n", p_name);
     }
-    return false;
+    outqueue_send(clients[index].queue, LANE_CONTROL, output, strlen(output));
 }
 
-bool checkWHO(char* message) {
-    return checkCommand("WHO", message);
+static void DeliverBroadcast(const char* from, const char* text)
+{
+    char message[MAXLINE];
+    int message_length = formatBroadcast(message, sizeof(message), from, text);
+    frame_t* frame = frame_new(message, message_length);
+    if (frame != NULL) {
+        SendToAll(frame, -1);
+        frame_unref(frame);
+    }
 }
 
-bool checkJOIN(char* message) {
-    return checkCommand("JOIN ", message);
+static void DeliverNotice(const char* text)
+{
+    frame_t* frame = frame_new(text, strlen(text));
+    if (frame != NULL) {
+        SendToAll(frame, -1);
+        frame_unref(frame);
+    }
 }
 
-bool checkLEAVE(char* message) {
-    return checkCommand("LEAVE", message);
+static bool DeliverDM(const char* from, const char* to, const char* text)
+{
+    char message[MAXLINE];
+    bool found = false;
+
+    int length = trace_echo(message, sizeof(message)); // only for traced messages
+    snprintf(message + length, sizeof(message) - length, "[%s] (DM) %s", from, text);
+
+    sem_wait(&mutex);
+    for (int i = 0; i < MAX_CLIENTS && !found; i++) {
+        if ((clients[i].name != NULL) && (0 == strcmp(clients[i].name, to))) {
+            outqueue_send(clients[i].queue, LANE_BULK, message, strlen(message));
+            found = true;
+        }
+    }
+    sem_post(&mutex);
+    return found;
 }
 
-bool checkVERSION(char* message) {
-    return checkCommand("VERSION", message);
+static void ForEachLocalClient(void (*fn)(const char* name, void* arg), void* arg)
+{
+    sem_wait(&mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].name != NULL) {
+            fn(clients[i].name, arg);
+        }
+    }
+    sem_post(&mutex);
+}
+
+static int RingAccepted(int fd, outqueue_t* queue)
+{
+    return ReserveSlot(fd, false, queue);
+}
+
+static uring_action_t RingLine(int index, char* line)
+{
+    trace_begin(clients[index].fd, strlen(line));
+    command_t command = DispatchLine(line, index);
+    trace_end();
+
+    switch (command) {
+    case CMD_LEAVE:
+        return URING_DONE;
+    case CMD_PEER:
+        return URING_HANDOFF;
+    default:
+        return URING_CONTINUE;
+    }
+}
+
+static void RingClosed(int index)
+{
+    RemoveClient(index, false);
+}
+
+typedef struct {
+    int index;
+    char first[MAXLINE];
+    linebuf_t input;
+} handoff_t;
+
+/*
+ * RingLink - thread function that serves a federation link accepted by
+ * the io_uring loop, which still sends its output
+ */
+static void* RingLink(void* arg)
+{
+    handoff_t* handoff = (handoff_t*)arg;
+    transport_t transport;
+
+    pthread_detach(pthread_self());
+    transport_init_socket(&transport, clients[handoff->index].fd);
+    fed_serve_link(&transport, clients[handoff->index].queue, &handoff->input, handoff->first);
+    RemoveClient(handoff->index, false);
+    free(handoff);
+    return NULL;
+}
+
+static void RingHandoff(int index, const char* first, linebuf_t* input)
+{
+    pthread_t tid;
+    handoff_t* handoff = malloc(sizeof(handoff_t));
+
+    MarkLink(index);
+    if (handoff != NULL) {
+        handoff->index = index;
+        snprintf(handoff->first, sizeof(handoff->first), "%s", first);
+        handoff->input = *input;
+        if (pthread_create(&tid, NULL, RingLink, handoff) == 0) {
+            return;
+        }
+        free(handoff);
+    }
+    RemoveClient(index, false);
+}
+
+static void* RingThread(void* arg)
+{
+    (void)arg;
+    uring_run();
+    return NULL;
+}
+
+static int parseQueueOption(int option, const char* value) {
+    switch (option) {
+    case 'q':
+        if (0 == strcmp(value, "strict")) {
+            queue_config.policy = SCHED_STRICT;
+        } else if (0 == strcmp(value, "weighted")) {
+            queue_config.policy = SCHED_WEIGHTED;
+        } else {
+            fprintf(stderr, "unknown scheduling policy: %s\n", value);
+            return -1;
+        }
+        return 0;
+    case 'w':
+        queue_config.control_weight = atoi(value);
+        if (queue_config.control_weight < 1) {
+            fprintf(stderr, "the control weight must be at least 1\n");
+            return -1;
+        }
+        return 0;
+    case 'b':
+        queue_config.bulk_limit = strtoul(value, NULL, 10);
+        if (queue_config.bulk_limit < MAXLINE) {
+            fprintf(stderr, "the bulk limit must be at least %d bytes\n", MAXLINE);
+            return -1;
+        }
+        return 0;
+    case 's':
+        queue_config.sndbuf = atoi(value); // 0 keeps the default of the system
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static char* removeLeadingSpaces(char* message) {
+    if (*message == NULL) return NULL;
+
+    char* pstring = message;
+    // skip all leading whitespaces
+    while((*pstring == ' ') || (*pstring == '\t')) { pstring++; }
+    return *pstring;
 }
 
 // TODO: you may want the HandleHELP command here, because if you add new commands, you can just implement them in the server and don't have really to change the client
@@ -0,0 +1,161 @@
+// chattrace.c - latency tracing of the messages through the server
+#include "chattrace.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    long long ns;
+    unsigned long long id;
+    int hop;
+    int fd;
+    long value;
+} trace_event_t;
+
+__thread trace_ctx_t trace_current;
+unsigned int trace_sample_rate = 0;
+
+static const char* hop_names[TRACE_HOPS] = { "recv", "parse", "enqueue", "write" };
+
+// writers take a position with an atomic increment, no lock. An event
+// being written while dumped may come out torn, it is only a trace.
+static trace_event_t events[TRACE_BUFFER_EVENTS];
+static unsigned long long next_event = 0;
+static unsigned long long next_id = 0;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void record_at(long long ns, trace_hop_t hop, unsigned long long id, int fd, long value)
+{
+    unsigned long long position = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+    trace_event_t* event = &events[position & (TRACE_BUFFER_EVENTS - 1)];
+    event->ns = ns;
+    event->id = id;
+    event->hop = hop;
+    event->fd = fd;
+    event->value = value;
+}
+
+void trace_record(trace_hop_t hop, unsigned long long id, int fd, long value)
+{
+    record_at(now_ns(), hop, id, fd, value);
+}
+
+static void trace_dump(void)
+{
+    unsigned long long last = __atomic_load_n(&next_event, __ATOMIC_RELAXED);
+    unsigned long long first = (last > TRACE_BUFFER_EVENTS) ? last - TRACE_BUFFER_EVENTS : 0;
+
+    fprintf(stdout, "trace: %llu events (id hop time_ns fd value)\n", last - first);
+    for (unsigned long long i = first; i < last; i++) {
+        trace_event_t* event = &events[i & (TRACE_BUFFER_EVENTS - 1)];
+        fprintf(stdout, "trace %llu %s %lld %d %ld\n", event->id,
+                (event->hop >= 0 && event->hop < TRACE_HOPS) ? hop_names[event->hop] : "?",
+                event->ns, event->fd, event->value);
+    }
+    fflush(stdout);
+}
+
+/*
+ * TraceDumper - thread function that prints the trace buffer
+ * every time the process gets SIGUSR1
+ */
+static void* TraceDumper(void* arg)
+{
+    sigset_t* signals = (sigset_t*)arg;
+    int signal_number;
+
+    while (1) {
+        if (sigwait(signals, &signal_number) == 0) {
+            trace_dump();
+        }
+    }
+    return NULL;
+}
+
+int trace_init(void)
+{
+    static sigset_t signals;
+    pthread_t tid;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) return -1;
+    if (pthread_create(&tid, NULL, TraceDumper, &signals) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void trace_begin(int fd, size_t len)
+{
+    trace_ctx_t* ctx = &trace_current;
+
+    ctx->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    ctx->sampled = (trace_sample_rate > 0) && (ctx->id % trace_sample_rate == 0);
+    ctx->echo = false;
+    ctx->fd = fd;
+    ctx->len = len;
+    ctx->recv_ns = now_ns();
+    ctx->parsed_ns = 0;
+
+    CHAT_PROBE(recv, ctx->id, fd, len);
+    if (ctx->sampled) {
+        record_at(ctx->recv_ns, TRACE_RECV, ctx->id, fd, len);
+    }
+}
+
+char* trace_parse_prefix(char* line)
+{
+    trace_ctx_t* ctx = &trace_current;
+    size_t prefix = strlen(TRACE_PREFIX);
+
+    if (ctx->id == 0 || strncmp(line, TRACE_PREFIX, prefix) != 0) return line;
+
+    char* end = NULL;
+    unsigned long long id = strtoull(line + prefix, &end, 10);
+    if (end == line + prefix || (*end != ' ' && *end != '\t')) return line;
+
+    // the message goes on with the id of the client, and is always recorded
+    ctx->id = id;
+    ctx->sampled = true;
+    ctx->echo = true;
+    record_at(ctx->recv_ns, TRACE_RECV, ctx->id, ctx->fd, ctx->len);
+
+    while (*end == ' ' || *end == '\t') { end++; }
+    return end;
+}
+
+void trace_parsed(int fd, int command)
+{
+    trace_ctx_t* ctx = &trace_current;
+    if (ctx->id == 0) return;
+
+    ctx->parsed_ns = now_ns();
+    CHAT_PROBE(parse, ctx->id, fd, command);
+    if (ctx->sampled) {
+        record_at(ctx->parsed_ns, TRACE_PARSE, ctx->id, fd, command);
+    }
+}
+
+void trace_end(void)
+{
+    memset(&trace_current, 0, sizeof(trace_current));
+}
+
+int trace_echo(char* out, size_t len)
+{
+    trace_ctx_t* ctx = &trace_current;
+    if (!ctx->echo) return 0;
+
+    int n = snprintf(out, len, TRACE_PREFIX "%llu %lld %lld ", ctx->id,
+                     ctx->recv_ns / 1000, ctx->parsed_ns / 1000);
+    return (n < 0 || (size_t)n >= len) ? 0 : n;
+}
@@ -0,0 +1,111 @@
+// chattrace.h - latency tracing of the messages through the server
+//
+// Every line received gets an id, and its hops are marked:
+//  - recv:    the line is read from the connection
+//  - parse:   the command is known
+//  - enqueue: a frame of the message is queued for a recipient
+//  - write:   the frame is written to the socket of the recipient
+// Each hop is a static tracepoint (USDT, provider "chatserver") when
+// <sys/sdt.h> is available: a nop until a tracer attaches to it. For
+// example, with bpftrace:
+//
+//     bpftrace -e 'usdt:./chatserver:chatserver:write { @[arg1] = count(); }'
+//
+// The arguments are always (message id, fd, bytes or command).
+//
+// Besides, one message of every 'trace_sample_rate' is recorded in a ring
+// buffer in memory, that is printed on SIGUSR1.
+//
+// A client can choose the id of a message with the prefix
+//
+//     TRACE <id> <line>
+//
+// Such a message is always recorded, and the recipients get it with
+//
+//     TRACE <id> <recv_us> <parsed_us> [name] message
+//
+// the times (CLOCK_REALTIME, microseconds) when the server read and parsed
+// it. With its own send and receive times, a client can tell the network
+// from the server, and in the trace buffer the queueing from the fan-out.
+
+#ifndef __CHAT_TRACE
+#define __CHAT_TRACE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CHAT_PROBE(name, id, fd, value) DTRACE_PROBE3(chatserver, name, id, fd, value)
+#endif
+#endif
+#ifndef CHAT_PROBE
+#define CHAT_PROBE(name, id, fd, value) do { } while (0)
+#endif
+
+#define TRACE_BUFFER_EVENTS (16384) // events kept in memory, a power of 2
+#define TRACE_PREFIX "TRACE "
+
+typedef enum {
+    TRACE_RECV = 0,
+    TRACE_PARSE,
+    TRACE_ENQUEUE,
+    TRACE_WRITE,
+    TRACE_HOPS
+} trace_hop_t;
+
+// the message being handled by a thread
+typedef struct {
+    unsigned long long id;  // 0 when there is none
+    bool sampled;           // its hops are recorded in the buffer
+    bool echo;              // the client gave the id, the recipients get it back
+    int fd;                 // connection it came from
+    size_t len;
+    long long recv_ns;      // CLOCK_REALTIME
+    long long parsed_ns;
+} trace_ctx_t;
+
+extern __thread trace_ctx_t trace_current;
+
+// record one of every trace_sample_rate messages, 0 for none
+extern unsigned int trace_sample_rate;
+
+/*
+ * trace_init - print the trace buffer on SIGUSR1. Call it before any
+ * other thread is created: the signal is blocked for all of them, and
+ * waited for by a thread of its own.
+ * return -1 in case of failure
+ */
+int trace_init(void);
+
+// add an event to the trace buffer
+void trace_record(trace_hop_t hop, unsigned long long id, int fd, long value);
+
+// a line of len bytes was received from fd: it becomes the current message
+void trace_begin(int fd, size_t len);
+
+// take the TRACE <id> prefix out of line, if any, return the rest
+char* trace_parse_prefix(char* line);
+
+// the command of the current message is known
+void trace_parsed(int fd, int command);
+
+// the current message is handled
+void trace_end(void);
+
+/*
+ * trace_echo - write the TRACE prefix for the recipients of the current
+ * message into out, if its client gave an id
+ * return the length written, 0 if none
+ */
+int trace_echo(char* out, size_t len);
+
+// hops of a frame of a traced message, id 0 if it has none
+#define TRACE_FRAME_HOP(probe, hop, id, sampled, fd, len) \
+    do { \
+        CHAT_PROBE(probe, id, fd, len); \
+        if (sampled) { trace_record(hop, id, fd, len); } \
+    } while (0)
+
+#endif //__CHAT_TRACE
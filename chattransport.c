@@ -0,0 +1,389 @@
+// chattransport.c - socket and shared memory transports
+#define _GNU_SOURCE // for memfd_create
+#include "chattransport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#define SHM_SPIN (64)       // checks of an empty/full ring before sleeping
+#define SHM_BELLS (4)       // c2s data, c2s space, s2c data, s2c space
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) // of the memfd
+#define CACHE_LINE (64)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+// single producer / single consumer ring, head and tail grow forever
+// and wrap around with the mask, so head - tail are the bytes in use
+typedef struct {
+    uint32_t head;              // written by the producer
+    char pad1[CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail;              // written by the consumer
+    char pad2[CACHE_LINE - sizeof(uint32_t)];
+    uint32_t data_waiting;      // the consumer sleeps on the data bell
+    uint32_t space_waiting;     // the producer sleeps on the space bell
+    char pad3[CACHE_LINE - 2 * sizeof(uint32_t)];
+    char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+typedef struct {
+    shm_ring_t c2s;     // client to server
+    shm_ring_t s2c;     // server to client
+} shm_region_t;
+
+struct shm_chan {
+    shm_region_t* region;
+    shm_ring_t* rx;
+    shm_ring_t* tx;
+    int rx_data_bell;   // rung by the other side when rx has new data
+    int rx_space_bell;  // rung by us when we free space in rx
+    int tx_data_bell;   // rung by us when tx has new data
+    int tx_space_bell;  // rung by the other side when tx has free space
+};
+
+static size_t ring_used(shm_ring_t* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static size_t ring_read(shm_ring_t* ring, char* buf, size_t len)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t n = head - tail;
+    if (n > len) { n = len; }
+
+    size_t offset = tail & (SHM_RING_SIZE - 1);
+    size_t first = (n < SHM_RING_SIZE - offset) ? n : SHM_RING_SIZE - offset;
+    memcpy(buf, ring->data + offset, first);
+    memcpy(buf + first, ring->data, n - first);
+
+    // seq_cst: the check of space_waiting that follows must not move before it
+    __atomic_store_n(&ring->tail, tail + (uint32_t)n, __ATOMIC_SEQ_CST);
+    return n;
+}
+
+static size_t ring_write(shm_ring_t* ring, const char* buf, size_t len)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t n = SHM_RING_SIZE - (head - tail);
+    if (n > len) { n = len; }
+
+    size_t offset = head & (SHM_RING_SIZE - 1);
+    size_t first = (n < SHM_RING_SIZE - offset) ? n : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, buf, first);
+    memcpy(ring->data, buf + first, n - first);
+
+    // seq_cst: the check of data_waiting that follows must not move before it
+    __atomic_store_n(&ring->head, head + (uint32_t)n, __ATOMIC_SEQ_CST);
+    return n;
+}
+
+static void ring_bell(int bell)
+{
+    uint64_t one = 1;
+    ssize_t rv = write(bell, &one, sizeof(one));
+    (void)rv; // a full counter means the bell is already rung
+}
+
+static void clear_bell(int bell)
+{
+    uint64_t count;
+    ssize_t rv = read(bell, &count, sizeof(count));
+    (void)rv;
+}
+
+// true if the socket of a shared memory channel is closed
+static bool link_closed(int fd, int timeout)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    // the client never writes to the socket after the hello, so
+    // anything readable there is the end of the connection
+    return (poll(&pfd, 1, timeout) > 0);
+}
+
+// data to read (for_data) or space to write in the ring
+static bool ring_ready(shm_ring_t* ring, bool for_data)
+{
+    size_t used = ring_used(ring);
+    return for_data ? (used > 0) : (used < SHM_RING_SIZE);
+}
+
+/*
+ * wait_bell - wait until the ring is ready, spinning for a while and
+ * then sleeping on the bell, with the 'waiting' flag set so the other
+ * side knows it has to ring it.
+ * return -1 if the socket was closed
+ */
+static int wait_bell(int fd, int bell, uint32_t* waiting, shm_ring_t* ring, bool for_data)
+{
+    for (int i = 0; i < SHM_SPIN; i++) {
+        if (ring_ready(ring, for_data)) return 0;
+        cpu_relax();
+    }
+
+    int rv = 0;
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    while (!ring_ready(ring, for_data)) {
+        struct pollfd fds[2] = {
+            { .fd = bell, .events = POLLIN },
+            { .fd = fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            rv = -1;
+            break;
+        }
+        if (fds[0].revents & POLLIN) { clear_bell(bell); }
+        if ((fds[1].revents != 0) && !ring_ready(ring, for_data)) {
+            rv = -1; // the other side is gone
+            break;
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+    return rv;
+}
+
+void transport_init_socket(transport_t* transport, int fd)
+{
+    transport->fd = fd;
+    transport->shm = NULL;
+}
+
+static shm_chan_t* shm_chan_new(shm_region_t* region, int bells[SHM_BELLS], bool server)
+{
+    shm_chan_t* chan = calloc(1, sizeof(shm_chan_t));
+    if (chan == NULL) return NULL;
+
+    chan->region = region;
+    if (server) {
+        chan->rx = &region->c2s;
+        chan->tx = &region->s2c;
+        chan->rx_data_bell = bells[0];
+        chan->rx_space_bell = bells[1];
+        chan->tx_data_bell = bells[2];
+        chan->tx_space_bell = bells[3];
+    } else {
+        chan->rx = &region->s2c;
+        chan->tx = &region->c2s;
+        chan->rx_data_bell = bells[2];
+        chan->rx_space_bell = bells[3];
+        chan->tx_data_bell = bells[0];
+        chan->tx_space_bell = bells[1];
+    }
+    return chan;
+}
+
+int transport_connect_shm(transport_t* transport, const char* path)
+{
+    int bells[SHM_BELLS] = { -1, -1, -1, -1 };
+    shm_region_t* region = MAP_FAILED;
+    int memfd = -1;
+
+    int fd = open_unix_clientfd(path);
+    if (fd < 0) return -1;
+
+    // sealed, so the server knows its mapping can never lose its pages
+    memfd = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, sizeof(shm_region_t)) < 0) goto fail;
+    if (fcntl(memfd, F_ADD_SEALS, SHM_SEALS) < 0) goto fail;
+
+    region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) goto fail;
+
+    for (int i = 0; i < SHM_BELLS; i++) {
+        bells[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (bells[i] < 0) goto fail;
+    }
+
+    // send the hello with the memfd and the bells
+    int fds[1 + SHM_BELLS] = { memfd, bells[0], bells[1], bells[2], bells[3] };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = SHM_HELLO, .iov_len = strlen(SHM_HELLO) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) goto fail;
+    close(memfd); // the mapping stays
+
+    transport->fd = fd;
+    transport->shm = shm_chan_new(region, bells, false);
+    if (transport->shm == NULL) {
+        memfd = -1;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    reportErrno();
+    fprintf(stderr, "Error setting up the shared memory channel\n");
+    for (int i = 0; i < SHM_BELLS; i++) {
+        if (bells[i] >= 0) close(bells[i]);
+    }
+    if (region != MAP_FAILED) munmap(region, sizeof(shm_region_t));
+    if (memfd >= 0) close(memfd);
+    close(fd);
+    return -1;
+}
+
+/*
+ * shm_sealed - true if the memfd of a client has the size of a region
+ * and can not be resized: a client that truncates it after the mmap
+ * would make the server crash with SIGBUS
+ */
+static bool shm_sealed(int memfd)
+{
+    struct stat st;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_SEALS) != SHM_SEALS) return false;
+    return (fstat(memfd, &st) == 0) && (st.st_size == (off_t)sizeof(shm_region_t));
+}
+
+ssize_t transport_accept_local(transport_t* transport, linebuf_t* input)
+{
+    int fds[1 + SHM_BELLS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = input->data + input->end, .iov_len = sizeof(input->data) - input->end };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(transport->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return n;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+        input->end += n; // a plain unix socket client
+        return n;
+    }
+
+    int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+
+    shm_region_t* region = MAP_FAILED;
+    if ((received == 1 + SHM_BELLS) && (n >= (ssize_t)strlen(SHM_HELLO))
+        && (0 == memcmp(iov.iov_base, SHM_HELLO, strlen(SHM_HELLO))) && shm_sealed(fds[0])) {
+        region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    close(fds[0]);
+    if (region != MAP_FAILED) {
+        transport->shm = shm_chan_new(region, fds + 1, true);
+    }
+    if (transport->shm == NULL) {
+        fprintf(stderr, "invalid shared memory hello on fd %d\n", transport->fd);
+        for (int i = 1; i < received; i++) close(fds[i]);
+        if (region != MAP_FAILED) munmap(region, sizeof(shm_region_t));
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+ssize_t transport_fill(transport_t* transport, linebuf_t* input, bool nonblocking)
+{
+    shm_chan_t* chan = transport->shm;
+    if (chan == NULL) {
+        return linebuf_fill(input, transport->fd);
+    }
+
+    // move the partial line to the front to make room, as linebuf_fill()
+    if (input->start > 0) {
+        memmove(input->data, input->data + input->start, input->end - input->start);
+        input->end -= input->start;
+        input->start = 0;
+    }
+    if (input->end == sizeof(input->data)) { return 1; }
+
+    if (nonblocking) {
+        // awake now, transport_prepare_poll() sets the flag again
+        __atomic_store_n(&chan->rx->data_waiting, 0, __ATOMIC_SEQ_CST);
+        clear_bell(chan->rx_data_bell);
+        if (ring_used(chan->rx) == 0) {
+            if (link_closed(transport->fd, 0)) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+    } else if (wait_bell(transport->fd, chan->rx_data_bell, &chan->rx->data_waiting, chan->rx, true) < 0) {
+        return 0; // the other side is gone
+    }
+
+    size_t n = ring_read(chan->rx, input->data + input->end, sizeof(input->data) - input->end);
+    input->end += n;
+    if (__atomic_load_n(&chan->rx->space_waiting, __ATOMIC_SEQ_CST)) {
+        ring_bell(chan->rx_space_bell);
+    }
+    return n;
+}
+
+int transport_write(transport_t* transport, const char* buf, size_t len)
+{
+    shm_chan_t* chan = transport->shm;
+    if (chan == NULL) {
+        int length = (int)len;
+        return sendall(transport->fd, (char*)buf, &length, MSG_NOSIGNAL);
+    }
+
+    while (len > 0) {
+        size_t n = ring_write(chan->tx, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+            if (__atomic_load_n(&chan->tx->data_waiting, __ATOMIC_SEQ_CST)) {
+                ring_bell(chan->tx_data_bell);
+            }
+            continue;
+        }
+        // the ring is full, wait for the other side to read
+        if (wait_bell(transport->fd, chan->tx_space_bell, &chan->tx->space_waiting, chan->tx, false) < 0) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int transport_pollfd(transport_t* transport)
+{
+    return (transport->shm != NULL) ? transport->shm->rx_data_bell : transport->fd;
+}
+
+bool transport_prepare_poll(transport_t* transport)
+{
+    shm_chan_t* chan = transport->shm;
+    if (chan == NULL) return false;
+
+    __atomic_store_n(&chan->rx->data_waiting, 1, __ATOMIC_SEQ_CST);
+    return (ring_used(chan->rx) > 0);
+}
+
+void transport_release(transport_t* transport)
+{
+    shm_chan_t* chan = transport->shm;
+    if (chan == NULL) return;
+
+    close(chan->rx_data_bell);
+    close(chan->rx_space_bell);
+    close(chan->tx_data_bell);
+    close(chan->tx_space_bell);
+    munmap(chan->region, sizeof(shm_region_t));
+    free(chan);
+    transport->shm = NULL;
+}
@@ -0,0 +1,80 @@
+// chattransport.h - transports of the chat connections
+//
+// The protocol is the same on every transport, only the way the bytes
+// travel changes:
+//  - sockets: TCP, or unix domain sockets for clients on the same host.
+//  - shared memory: for local clients that want the lowest latency. The
+//    client connects to the unix domain socket of the server and sends
+//    "SHM\n" with a memfd, sealed so it can not be resized, and four
+//    eventfds (SCM_RIGHTS). The memfd holds two single producer / single
+//    consumer rings, one per direction, and the eventfds are the
+//    doorbells that wake up a side sleeping for data, or for free space
+//    in a full ring. A doorbell is only rung when the other side is
+//    sleeping, so a busy channel moves its messages without system calls.
+//    The unix socket stays open: when it is closed the channel is over.
+
+#ifndef __CHAT_TRANSPORT
+#define __CHAT_TRANSPORT
+
+#include "nethelp.h"
+#include <stdbool.h>
+
+#define SHM_RING_SIZE (64 * 1024) // bytes of each ring, a power of 2
+#define SHM_HELLO "SHM\n"
+
+typedef struct shm_chan shm_chan_t;
+
+typedef struct {
+    int fd;             // the socket of the connection
+    shm_chan_t* shm;    // the shared memory channel, NULL for sockets
+} transport_t;
+
+// a transport over the socket fd
+void transport_init_socket(transport_t* transport, int fd);
+
+/*
+ * transport_connect_shm - connect to the unix domain socket path and
+ * set up a shared memory channel with the server
+ * return -1 in case of failure
+ */
+int transport_connect_shm(transport_t* transport, const char* path);
+
+/*
+ * transport_accept_local - first read of a client accepted on the unix
+ * domain socket: if it is the hello of a shared memory channel, the
+ * transport switches to it. Otherwise the data read is left in input.
+ * return the bytes read as transport_fill()
+ */
+ssize_t transport_accept_local(transport_t* transport, linebuf_t* input);
+
+/*
+ * transport_fill - read once from the transport into input. Blocks for
+ * sockets, and for shared memory channels unless 'nonblocking' is set.
+ * return 0 on EOF, -1 in case of failure (errno EAGAIN if nonblocking
+ * and there is nothing to read)
+ */
+ssize_t transport_fill(transport_t* transport, linebuf_t* input, bool nonblocking);
+
+/*
+ * transport_write - write all the bytes, waiting for space if needed
+ * return -1 in case of failure
+ */
+int transport_write(transport_t* transport, const char* buf, size_t len);
+
+/*
+ * transport_pollfd - descriptor that becomes readable when there is
+ * input, for poll(). For shared memory channels, call
+ * transport_prepare_poll() before polling it.
+ */
+int transport_pollfd(transport_t* transport);
+
+/*
+ * transport_prepare_poll - tell the other side we are going to sleep
+ * return true if there is input already, and poll must not block
+ */
+bool transport_prepare_poll(transport_t* transport);
+
+// release the shared memory channel, if any. The socket is not closed.
+void transport_release(transport_t* transport);
+
+#endif //__CHAT_TRANSPORT
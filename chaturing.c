@@ -0,0 +1,637 @@
+// chaturing.c - io_uring backend, with the raw system calls (no liburing)
+#include "chaturing.h"
+#include "chatadmit.h"
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// built with the headers of Linux 6.0 or later: multishot recv and the
+// provided buffer rings. Otherwise only a stub, for the threaded backend
+#ifdef IORING_RECV_MULTISHOT
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// kind of request, in the low bits of its user_data (the connection)
+enum {
+    OP_IGNORE = 0,  // cancellations, their result does not matter
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_TIMEOUT,
+    OP_WAKE,
+    OP_BACKOFF      // accept again after running out of descriptors
+};
+#define OP_MASK (7ULL)
+
+typedef struct uring_conn {
+    int fd;
+    int index;              // slot in the array of clients
+    outqueue_t* queue;
+    linebuf_t input;
+    int ops;                // requests of the connection in the ring
+    bool reading;           // the multishot recv is armed
+    bool stopped;           // the lines are not handled anymore
+    bool handoff;           // hand the connection off when the recv is over
+    bool closing;           // the queue was destroyed by the server
+    bool shut;              // the socket was shut down, waiting for the ops
+    bool timer;             // the flush timeout is armed
+    struct __kernel_timespec timeout;
+    char* first;            // line that asked for the hand-off
+    frame_t* sending[URING_BATCH];
+    int batch;              // frames of the chain in flight
+    int pending_sends;      // sends of the chain not completed yet
+    bool ready;             // in the ready list, under ready_lock
+    struct uring_conn* next_ready;
+} uring_conn_t;
+
+static uring_hooks_t hooks;
+static int ring_fd = -1;
+static int listen_fd = -1;
+static int wake_fd = -1;     // eventfd, other threads wake up the loop
+static uint64_t wake_value;
+static struct __kernel_timespec backoff = { 0, ADMISSION_BACKOFF_MS * 1000000LL };
+static pthread_t ring_thread;
+
+// submission queue, filled by this thread only
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static unsigned sq_entries;
+static unsigned sq_local_tail;  // the kernel sees it on the next submit
+static unsigned to_submit;
+static struct io_uring_sqe* sqes;
+
+// completion queue
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+
+// buffers provided to the kernel for the multishot recvs
+static struct io_uring_buf_ring* buf_ring;
+static char* buffers;
+static unsigned short buf_tail;
+
+// connections with frames to send, or closed by the server
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static uring_conn_t* ready_list = NULL;
+
+static void service(uring_conn_t* conn);
+
+static int ring_submit(unsigned wait)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    int rv = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rv > 0) { to_submit -= rv; }
+    return rv;
+}
+
+// make room for n requests, submitting the ones already filled
+static void sq_reserve(unsigned n)
+{
+    while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + n > sq_entries) {
+        if (ring_submit(0) < 0 && errno != EINTR && errno != EBUSY) { break; }
+    }
+}
+
+static struct io_uring_sqe* get_sqe(void)
+{
+    sq_reserve(1);
+    unsigned index = sq_local_tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sq_local_tail++;
+    to_submit++;
+    return sqe;
+}
+
+static void buffer_recycle(unsigned short bid)
+{
+    struct io_uring_buf* buf = &buf_ring->bufs[buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(void)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void arm_backoff(void)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&backoff;
+    sqe->len = 1;
+    sqe->user_data = OP_BACKOFF;
+}
+
+static void arm_wake(void)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uintptr_t)&wake_value;
+    sqe->len = sizeof(wake_value);
+    sqe->user_data = OP_WAKE;
+}
+
+static void arm_recv(uring_conn_t* conn)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uintptr_t)conn | OP_RECV;
+    conn->reading = true;
+    conn->ops++;
+}
+
+static void arm_timer(uring_conn_t* conn)
+{
+    conn->timeout.tv_sec = URING_FLUSH_TIMEOUT_SEC;
+    conn->timeout.tv_nsec = 0;
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&conn->timeout;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)conn | OP_TIMEOUT;
+    conn->timer = true;
+    conn->ops++;
+}
+
+// cancel the request of the connection with kind op
+static void cancel(uring_conn_t* conn, int op)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = (op == OP_TIMEOUT) ? IORING_OP_TIMEOUT_REMOVE : IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)conn | op;
+    sqe->user_data = OP_IGNORE;
+}
+
+/*
+ * send_batch - take the next frames of the queue and send them as a
+ * chain of linked sends: each one starts when the previous is done
+ */
+static void send_batch(uring_conn_t* conn)
+{
+    zip_class_t classes[URING_BATCH];
+    int n = outqueue_take(conn->queue, conn->sending, classes, URING_BATCH, URING_BATCH_BYTES);
+    if (n == 0) return;
+
+    sq_reserve(n); // a chain can not be split between two submissions
+    for (int i = 0; i < n; i++) {
+        const char* data;
+        size_t len;
+        frame_encode(conn->sending[i], classes[i], &data, &len);
+        conn->queue->raw_bytes += conn->sending[i]->len;
+        conn->queue->sent_bytes += len;
+
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uintptr_t)data;
+        sqe->len = len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags = (i + 1 < n) ? IOSQE_IO_LINK : 0;
+        sqe->user_data = (uintptr_t)conn | OP_SEND;
+    }
+    conn->batch = n;
+    conn->pending_sends = n;
+    conn->ops += n;
+}
+
+// stop the input and the output of the connection
+static void shut(uring_conn_t* conn)
+{
+    if (conn->shut) return;
+    conn->shut = true;
+
+    shutdown(conn->fd, SHUT_RDWR);
+    if (conn->reading) { cancel(conn, OP_RECV); }
+    if (conn->timer) { cancel(conn, OP_TIMEOUT); }
+}
+
+// free the connection once shut down and without requests in the ring
+static void release_if_done(uring_conn_t* conn)
+{
+    if (!conn->shut || conn->ops > 0) return;
+
+    pthread_mutex_lock(&ready_lock);
+    bool ready = conn->ready;
+    pthread_mutex_unlock(&ready_lock);
+    if (ready) return; // it will be serviced again
+
+    close(conn->fd);
+    outqueue_free(conn->queue);
+    free(conn->first);
+    free(conn);
+}
+
+static void service(uring_conn_t* conn)
+{
+    bool flush;
+    if (!conn->closing && outqueue_closing(conn->queue, &flush)) {
+        conn->closing = true;
+        conn->stopped = true;
+        if (flush) {
+            arm_timer(conn); // a client that does not read can not hold it forever
+        } else {
+            shut(conn);
+        }
+    }
+
+    if (conn->batch == 0 && !conn->shut) {
+        send_batch(conn);
+    }
+    if (conn->closing && conn->batch == 0) {
+        shut(conn); // nothing more to flush
+    }
+    release_if_done(conn);
+}
+
+// called by the queues, from any thread
+static void notify(outqueue_t* queue, void* arg)
+{
+    (void)queue;
+    uring_conn_t* conn = (uring_conn_t*)arg;
+    bool wake = false;
+
+    pthread_mutex_lock(&ready_lock);
+    if (!conn->ready) {
+        // the loop looks at the list before waiting, only the other
+        // threads have to wake it up
+        wake = (ready_list == NULL) && !pthread_equal(pthread_self(), ring_thread);
+        conn->ready = true;
+        conn->next_ready = ready_list;
+        ready_list = conn;
+    }
+    pthread_mutex_unlock(&ready_lock);
+
+    if (wake) {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+}
+
+static void drain_ready(void)
+{
+    pthread_mutex_lock(&ready_lock);
+    uring_conn_t* list = ready_list;
+    ready_list = NULL;
+    for (uring_conn_t* conn = list; conn != NULL; conn = conn->next_ready) {
+        conn->ready = false;
+    }
+    pthread_mutex_unlock(&ready_lock);
+
+    while (list != NULL) {
+        uring_conn_t* next = list->next_ready;
+        service(list);
+        list = next;
+    }
+}
+
+static void dispatch_lines(uring_conn_t* conn)
+{
+    char line[MAXLINE];
+
+    while (!conn->stopped && linebuf_getline(&conn->input, line, sizeof(line)) > 0) {
+        switch (hooks.line(conn->index, line)) {
+        case URING_DONE:
+            conn->stopped = true;
+            break;
+        case URING_HANDOFF:
+            // the rest of the input goes to the new owner
+            conn->stopped = true;
+            conn->handoff = true;
+            conn->first = strdup(line);
+            if (conn->reading) { cancel(conn, OP_RECV); }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void consume(uring_conn_t* conn, const char* data, size_t len)
+{
+    while (len > 0 && (!conn->stopped || conn->handoff)) {
+        size_t copied = linebuf_append(&conn->input, data, len);
+        if (copied == 0 && conn->handoff) {
+            fprintf(stderr, "fd %d: input lost in the hand-off\n", conn->fd);
+            break;
+        }
+        data += copied;
+        len -= copied;
+        dispatch_lines(conn);
+    }
+}
+
+static void on_accept(int res, unsigned flags)
+{
+    if (res >= 0) {
+        uring_conn_t* conn = calloc(1, sizeof(uring_conn_t));
+        if (conn == NULL) {
+            close(res);
+        } else {
+            conn->fd = res;
+            linebuf_init(&conn->input);
+            conn->queue = outqueue_create_notify(res, notify, conn);
+            conn->index = (conn->queue != NULL) ? hooks.accepted(res, conn->queue) : -1;
+            if (conn->index < 0) {
+                if (conn->queue != NULL) { outqueue_free(conn->queue); }
+                close(res);
+                free(conn);
+            } else {
+                arm_recv(conn);
+            }
+        }
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+
+    // out of descriptors the multishot accept is over, and the pending
+    // connection still there: shed it with the spare one, or wait a bit
+    if ((res == -EMFILE || res == -ENFILE) && admission_accept_spare(listen_fd, false) < 0) {
+        arm_backoff();
+    } else {
+        arm_accept();
+    }
+}
+
+static void on_recv(uring_conn_t* conn, int res, unsigned flags)
+{
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0) {
+            consume(conn, buffers + (size_t)bid * URING_BUFFER_SIZE, res);
+        }
+        buffer_recycle(bid);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+
+    // the multishot recv is over: out of buffers, cancelled, EOF or error
+    conn->reading = false;
+    conn->ops--;
+    if (!conn->shut && !conn->handoff && (res > 0 || res == -ENOBUFS)) {
+        arm_recv(conn);
+        return;
+    }
+
+    if (conn->handoff) {
+        conn->handoff = false;
+        hooks.handoff(conn->index, conn->first, &conn->input);
+    } else if (!conn->stopped) {
+        conn->stopped = true;
+        hooks.closed(conn->index);
+    }
+    release_if_done(conn);
+}
+
+static void on_send(uring_conn_t* conn, int res)
+{
+    // the sends of a chain complete in order
+    frame_t* frame = conn->sending[conn->batch - conn->pending_sends];
+    TRACE_FRAME_HOP(write, TRACE_WRITE, frame->trace_id, frame->traced, conn->fd, res);
+
+    conn->ops--;
+    if (res < 0 && !conn->shut) {
+        outqueue_fail(conn->queue); // the client is gone, the rest of the chain is cancelled
+    }
+    if (--conn->pending_sends > 0) return;
+
+    for (int i = 0; i < conn->batch; i++) {
+        frame_unref(conn->sending[i]);
+    }
+    conn->batch = 0;
+    service(conn);
+}
+
+static void on_timeout(uring_conn_t* conn, int res)
+{
+    conn->ops--;
+    conn->timer = false;
+    if (res == -ETIME) {
+        shut(conn); // the flush took too long
+    }
+    release_if_done(conn);
+}
+
+static void reap(void)
+{
+    unsigned head = *cq_head;
+
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        uring_conn_t* conn = (uring_conn_t*)(uintptr_t)(user_data & ~OP_MASK);
+        switch (user_data & OP_MASK) {
+        case OP_ACCEPT:
+            on_accept(res, flags);
+            break;
+        case OP_RECV:
+            on_recv(conn, res, flags);
+            break;
+        case OP_SEND:
+            on_send(conn, res);
+            break;
+        case OP_TIMEOUT:
+            on_timeout(conn, res);
+            break;
+        case OP_WAKE:
+            arm_wake();
+            break;
+        case OP_BACKOFF:
+            arm_accept();
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/*
+ * wait_cqe - submit and wait for the next completion, for the checks
+ * of uring_init() only. return its result
+ */
+static int wait_cqe(unsigned* flags)
+{
+    while (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head) {
+        if (ring_submit(1) < 0 && errno != EINTR) {
+            *flags = 0;
+            return -errno;
+        }
+    }
+    struct io_uring_cqe* cqe = &cqes[*cq_head & *cq_mask];
+    int res = cqe->res;
+    *flags = cqe->flags;
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+    if (*flags & IORING_CQE_F_BUFFER) {
+        buffer_recycle(*flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    return res;
+}
+
+// the multishot recv came in Linux 6.0, a bit after the buffer rings
+static bool probe_multishot_recv(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return false;
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->user_data = OP_IGNORE;
+    write(sv[1], "x", 1);
+
+    unsigned flags = 0;
+    bool supported = (wait_cqe(&flags) == 1);
+    if (flags & IORING_CQE_F_MORE) {
+        shutdown(sv[0], SHUT_RDWR);
+        while (flags & IORING_CQE_F_MORE) {
+            wait_cqe(&flags);
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return supported;
+}
+
+static int ring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd < 0) return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (single) {
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+    }
+
+    char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    char* cq = sq;
+    if (!single) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return -1;
+
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // the ring of buffers for the recvs, shared with the kernel (5.19)
+    buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (buffers == NULL) return -1;
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        buffer_recycle(i);
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) return -1;
+
+    return probe_multishot_recv() ? 0 : -1;
+}
+
+int uring_init(int listenfd, const uring_hooks_t* uring_hooks)
+{
+    if (ring_setup() < 0) {
+        fprintf(stderr, "io_uring is not available, or the kernel is older than 6.0\n");
+        // the memory mapped stays, the server goes on with the threads
+        if (ring_fd >= 0) { close(ring_fd); }
+        if (wake_fd >= 0) { close(wake_fd); }
+        ring_fd = wake_fd = -1;
+        return -1;
+    }
+
+    hooks = *uring_hooks;
+    listen_fd = listenfd;
+    return 0;
+}
+
+void uring_run(void)
+{
+    ring_thread = pthread_self();
+    arm_accept();
+    arm_wake();
+
+    while (1) {
+        drain_ready();
+        if (ring_submit(1) < 0 && errno != EINTR && errno != EBUSY) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+        }
+        reap();
+    }
+}
+
+#else // !IORING_RECV_MULTISHOT
+
+int uring_init(int listenfd, const uring_hooks_t* uring_hooks)
+{
+    (void)listenfd;
+    (void)uring_hooks;
+    fprintf(stderr, "io_uring is not supported, built without the headers of Linux 6.0\n");
+    return -1;
+}
+
+void uring_run(void)
+{
+    abort(); // uring_init() always fails
+}
+
+#endif // IORING_RECV_MULTISHOT
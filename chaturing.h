@@ -0,0 +1,64 @@
+// chaturing.h - io_uring backend of the chat server
+//
+// Instead of two threads per TCP connection (reader and writer), a single
+// thread serves all of them from an io_uring event loop:
+//  - one multishot accept on the listening socket gets the connections.
+//  - one multishot recv per connection reads into a ring of buffers
+//    provided to the kernel, and the lines are reassembled in a linebuf.
+//  - the outbound queues have no writer thread, the loop takes their
+//    frames in batches and sends every batch as a chain of linked sends,
+//    so the frames of a connection keep their order.
+// The loop submits and reaps everything with one io_uring_enter() per
+// round, so under load the system calls per message tend to zero.
+//
+// The lines are handled by the same functions as with the threaded
+// backend, through the hooks. A federation link (PEER) is handed off to
+// a thread, as it blocks reading its lines.
+//
+// Needs Linux 6.0 (provided buffer rings, multishot accept and recv).
+// uring_init() fails on older kernels, or if io_uring is disabled, and
+// the server stays with the threaded backend. Built with older kernel
+// headers, the backend is left out and uring_init() always fails.
+
+#ifndef __CHAT_URING
+#define __CHAT_URING
+
+#include "chatqueue.h"
+#include "nethelp.h"
+
+#define URING_ENTRIES (4096)        // submission queue entries
+#define URING_BUFFERS (1024)        // provided buffers for recv, a power of 2
+#define URING_BUFFER_SIZE (4096)
+#define URING_BATCH (32)            // frames of a chain of linked sends
+#define URING_BATCH_BYTES (64 * 1024)
+#define URING_FLUSH_TIMEOUT_SEC (2) // max time to flush a closing connection
+
+typedef enum {
+    URING_CONTINUE = 0, // keep reading lines from the connection
+    URING_DONE,         // the client left, ignore the rest of its input
+    URING_HANDOFF       // serve the connection from a thread from now on
+} uring_action_t;
+
+// calls from the event loop into the server
+typedef struct {
+    // a new connection with its queue, return its slot or -1 to refuse it
+    int (*accepted)(int fd, outqueue_t* queue);
+    // a line of the connection in slot index
+    uring_action_t (*line)(int index, char* line);
+    // the client of slot index closed the connection, or it failed
+    void (*closed)(int index);
+    // the connection of slot index stopped reading after the line
+    // 'first', the rest of its input is in 'input'
+    void (*handoff)(int index, const char* first, linebuf_t* input);
+} uring_hooks_t;
+
+/*
+ * uring_init - set up the ring and check the kernel supports it
+ * return -1 if io_uring can not be used
+ */
+int uring_init(int listenfd, const uring_hooks_t* hooks);
+
+// serve the connections, never returns
+void uring_run(void);
+
+#endif //__CHAT_URING
@@ -0,0 +1,193 @@
+// chatzip.c - optional compression of the messages sent to a client
+#define _GNU_SOURCE // for memmem
+#include "chatzip.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+size_t zip_threshold = DEFAULT_ZIP_THRESHOLD;
+
+static const char* class_names[ZIP_CLASSES] = { "none", "plain", "chat" };
+
+// what the messages of the server are made of. deflate finds the
+// matches closer to the end sooner, the most common ones go last
+static const char chat_dictionary[] =
+    "No such user: usage: DM name message\n"
+    "Already joined as you have already joined\n"
+    "client: , with file descriptor: \n"
+    "Chat Server v0.1\nWelcome to the chat room, !\n\n"
+    "TRACE 1 the and you that this with have for not are but what was "
+    "just know like they will can all your from there would about "
+    "just leaved the chat room.\n\n"
+    "just leaved the chat room\n"
+    "has joined the chat room\n"
+    "] (DM) ";
+
+static const char* dictionaries[ZIP_CLASSES] = { NULL, NULL, chat_dictionary };
+
+// one stream per class and thread, reset for every record
+static __thread z_stream* deflaters[ZIP_CLASSES];
+static __thread z_stream* inflaters[ZIP_CLASSES];
+
+int zip_class_parse(const char* name)
+{
+    for (int i = 0; i < ZIP_CLASSES; i++) {
+        if (0 == strcmp(name, class_names[i])) return i;
+    }
+    return -1;
+}
+
+const char* zip_class_name(zip_class_t zclass)
+{
+    return (zclass >= 0 && zclass < ZIP_CLASSES) ? class_names[zclass] : "?";
+}
+
+static void put_u32(unsigned char* out, size_t value)
+{
+    out[0] = (value >> 24) & 0xff;
+    out[1] = (value >> 16) & 0xff;
+    out[2] = (value >> 8) & 0xff;
+    out[3] = value & 0xff;
+}
+
+static size_t get_u32(const unsigned char* in)
+{
+    return ((size_t)in[0] << 24) | ((size_t)in[1] << 16) | ((size_t)in[2] << 8) | in[3];
+}
+
+static z_stream* get_deflater(zip_class_t zclass)
+{
+    z_stream* stream = deflaters[zclass];
+    if (stream != NULL) {
+        if (deflateReset(stream) != Z_OK) return NULL;
+    } else {
+        stream = calloc(1, sizeof(z_stream));
+        if (stream == NULL) return NULL;
+        // raw deflate: the record has its own header
+        if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(stream);
+            return NULL;
+        }
+        deflaters[zclass] = stream;
+    }
+    if (dictionaries[zclass] != NULL
+        && deflateSetDictionary(stream, (const Bytef*)dictionaries[zclass],
+                                strlen(dictionaries[zclass])) != Z_OK) {
+        return NULL;
+    }
+    return stream;
+}
+
+static z_stream* get_inflater(zip_class_t zclass)
+{
+    z_stream* stream = inflaters[zclass];
+    if (stream != NULL) {
+        if (inflateReset(stream) != Z_OK) return NULL;
+    } else {
+        stream = calloc(1, sizeof(z_stream));
+        if (stream == NULL) return NULL;
+        if (inflateInit2(stream, -15) != Z_OK) {
+            free(stream);
+            return NULL;
+        }
+        inflaters[zclass] = stream;
+    }
+    // a raw stream does not ask for its dictionary, set it beforehand
+    if (dictionaries[zclass] != NULL
+        && inflateSetDictionary(stream, (const Bytef*)dictionaries[zclass],
+                                strlen(dictionaries[zclass])) != Z_OK) {
+        return NULL;
+    }
+    return stream;
+}
+
+bool zip_forced(const char* in, size_t len)
+{
+    // a message with a line starting like a record must be one: a WHO
+    // answer, or a notice, can have several lines
+    return (len > 0 && in[0] == ZIP_MARKER) || (memmem(in, len, "\n\x01", 2) != NULL);
+}
+
+size_t zip_bound(size_t len)
+{
+    size_t records = len / ZIP_CHUNK + 1;
+    return records * (ZIP_HEADER_SIZE + compressBound(ZIP_CHUNK));
+}
+
+int zip_compress(zip_class_t zclass, const char* in, size_t len, char* out, size_t outlen)
+{
+    if (zclass <= ZIP_NONE || zclass >= ZIP_CLASSES) return -1;
+
+    bool forced = zip_forced(in, len);
+    if (!forced && len < zip_threshold) return -1;
+    if (!forced && outlen > len) { outlen = len; } // must be smaller
+
+    size_t done = 0;
+    size_t total = 0;
+    do {
+        size_t chunk = (len - done > ZIP_CHUNK) ? ZIP_CHUNK : len - done;
+        if (outlen - total <= ZIP_HEADER_SIZE) return -1;
+
+        z_stream* stream = get_deflater(zclass);
+        if (stream == NULL) return -1;
+
+        char* record = out + total;
+        stream->next_in = (Bytef*)in + done;
+        stream->avail_in = chunk;
+        stream->next_out = (Bytef*)record + ZIP_HEADER_SIZE;
+        stream->avail_out = outlen - total - ZIP_HEADER_SIZE;
+        if (deflate(stream, Z_FINISH) != Z_STREAM_END) return -1; // out of room
+
+        size_t compressed = stream->total_out;
+        record[0] = ZIP_MARKER;
+        record[1] = (char)zclass;
+        put_u32((unsigned char*)record + 2, compressed);
+        put_u32((unsigned char*)record + 6, chunk);
+        total += ZIP_HEADER_SIZE + compressed;
+        done += chunk;
+    } while (done < len);
+    return (int)total;
+}
+
+static int decompress(zip_class_t zclass, const char* in, size_t len,
+                      char* out, size_t outlen)
+{
+    z_stream* stream = get_inflater(zclass);
+    if (stream == NULL) return -1;
+
+    stream->next_in = (Bytef*)in;
+    stream->avail_in = len;
+    stream->next_out = (Bytef*)out;
+    stream->avail_out = outlen;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END) return -1;
+    return stream->total_out;
+}
+
+int zip_getmessage(linebuf_t* input, char* line, int maxlen)
+{
+    size_t available = input->end - input->start;
+    unsigned char* begin = (unsigned char*)input->data + input->start;
+
+    if (available == 0 || begin[0] != (unsigned char)ZIP_MARKER) {
+        return linebuf_getline(input, line, maxlen);
+    }
+    if (available < ZIP_HEADER_SIZE) return 0;
+
+    zip_class_t zclass = begin[1];
+    size_t compressed = get_u32(begin + 2);
+    size_t len = get_u32(begin + 6);
+    if (zclass <= ZIP_NONE || zclass >= ZIP_CLASSES
+        || ZIP_HEADER_SIZE + compressed > sizeof(input->data) || len >= (size_t)maxlen) {
+        return -1;
+    }
+    if (available < ZIP_HEADER_SIZE + compressed) return 0; // wait for the rest
+
+    int n = decompress(zclass, (char*)begin + ZIP_HEADER_SIZE, compressed, line, len);
+    if (n != (int)len) return -1;
+    line[len] = '\0';
+
+    input->start += ZIP_HEADER_SIZE + compressed;
+    if (input->start == input->end) { input->start = input->end = 0; }
+    return (int)len;
+}
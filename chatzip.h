@@ -0,0 +1,75 @@
+// chatzip.h - optional compression of the messages sent to a client
+//
+// A client asks for it with "COMPRESS <class>". From then on, the
+// messages of at least 'zip_threshold' bytes it gets are records:
+//
+//     ZIP_MARKER <class> <compressed length> <length> <deflate data>
+//
+// (the lengths are 4 bytes, big endian), and the rest stay lines of text.
+// A message with a line starting with ZIP_MARKER is always sent as a
+// record, so the client can tell them apart. A message longer than
+// ZIP_CHUNK bytes is sent as several records, ZIP_CHUNK bytes of it
+// each, so every record fits the line buffer of the client.
+//
+// The answer to COMPRESS ("Compression: <class>, messages of <threshold>
+// bytes or more") is the last message sent with the former class: a
+// client only reads records after it, and plain lines after the answer
+// to "COMPRESS none", where a line starting with ZIP_MARKER is text.
+//
+// Every record is compressed on its own (raw deflate), with the preset
+// dictionary of its class: short messages compress well, because the
+// dictionary holds the words they are made of, and a broadcast is
+// compressed once for all the recipients of a class instead of once
+// per connection, as a stream with its own state would need.
+// A message that does not get smaller is sent as is.
+
+#ifndef __CHAT_ZIP
+#define __CHAT_ZIP
+
+#include "nethelp.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ZIP_MARKER '\x01'
+#define ZIP_HEADER_SIZE (10)
+#define ZIP_CHUNK (4096)            // max bytes of a message in a record
+#define DEFAULT_ZIP_THRESHOLD (256) // smaller messages are not worth it
+
+typedef enum {
+    ZIP_NONE = 0,   // no compression
+    ZIP_PLAIN,      // deflate without dictionary
+    ZIP_CHAT,       // deflate with the dictionary of the chat messages
+    ZIP_CLASSES
+} zip_class_t;
+
+// messages shorter than this are never compressed
+extern size_t zip_threshold;
+
+// the class called name ("none", "plain" or "chat"), -1 if unknown
+int zip_class_parse(const char* name);
+
+const char* zip_class_name(zip_class_t zclass);
+
+// true if the message in[len] has to be sent as records, whatever its size
+bool zip_forced(const char* in, size_t len);
+
+// the max length of the records of a message of len bytes
+size_t zip_bound(size_t len);
+
+/*
+ * zip_compress - build the records of the message in[len] for zclass
+ * into out (of outlen bytes, zip_bound(len) is always enough)
+ * return their length, -1 if the message is to be sent as is: below the
+ * threshold, or the records would not be smaller. A forced message only
+ * fails when out is too small, or without memory for zlib
+ */
+int zip_compress(zip_class_t zclass, const char* in, size_t len, char* out, size_t outlen);
+
+/*
+ * zip_getmessage - the next message from input: a line, or a record
+ * decompressed into line (with a '\0' at the end)
+ * return its length, 0 if it is not complete yet, -1 if it is corrupt
+ */
+int zip_getmessage(linebuf_t* input, char* line, int maxlen);
+
+#endif //__CHAT_ZIP
@@ -0,0 +1,435 @@
+/*
+ * microbench.c - microbenchmarks for the hot paths of the chat protocol
+ *
+ * Times the functions used for every message in isolation, without a
+ * running server: readline(), its buffered successor linebuf and
+ * sendall() over in-memory socketpairs, the command parsing/dispatch,
+ * ltrim()/rtrim(), the formatting of the broadcast frames, the
+ * fan-out of a broadcast to a large room over the pool of workers and
+ * the compression of a large message.
+ *
+ * usage: ./chatmicrobench [iterations]
+ *
+ * The results are printed to stdout as JSON, one entry per benchmark,
+ * always in the same order and with the same keys, so the output of two
+ * commits can be compared with diff or any JSON tool.
+ *
+ * Every benchmark is repeated BENCH_REPEAT times and the median is
+ * reported, to filter out the noise of the scheduler.
+ *
+ * Allocations are counted wrapping malloc()/calloc()/realloc()/free()
+ * with the linker (see the 'chatmicrobench' target in the Makefile),
+ * so only the allocations done by the code of this repo are counted.
+ * The benchmarks that are mostly a library (zlib) report them as null.
+ */
+
+#include "nethelp.h"
+#include "chatproto.h"
+#include "chatfanout.h"
+#include "chatzip.h"
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#define BENCH_DEFAULT_ITERATIONS (200000)
+#define BENCH_REPEAT (5)
+#define BENCH_BATCH (64)    // lines in flight in a socketpair at once
+#define BENCH_ROOM (16384)  // recipients of the fan-out benchmark
+
+// allocation counters, updated by the linker wrappers
+
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void  __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr) {
+    __real_free(ptr);
+}
+
+// result of one benchmark
+typedef struct {
+    const char* name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double alloc_bytes_per_op;
+    bool allocs_unknown;    // not counted, see bench_t
+} bench_result_t;
+
+// a benchmark runs 'iterations' operations and returns the
+// nanoseconds spent in the measured part
+typedef uint64_t (*bench_fn_t)(uint64_t iterations);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// the lines used as input, a mix of commands and chat messages
+static const char* sample_lines[] = {
+    "JOIN Melissa\n",
+    "WHO\n",
+    "Hello there, how is everybody doing today?\n",
+    "VERSION\n",
+    "this is a somewhat longer chat message, that could be a paste of a few words\n",
+    "LEAVE\n",
+};
+#define SAMPLE_LINES (sizeof(sample_lines) / sizeof(sample_lines[0]))
+
+static int make_socketpair(int sv[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "socketpair failed\n");
+        reportErrno();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * readline over a socketpair: a batch of lines is written to one end
+ * (not measured) and then read back with readline() (measured).
+ */
+static uint64_t bench_readline(uint64_t iterations) {
+    int sv[2];
+    char buf[MAXLINE];
+    uint64_t spent = 0;
+
+    if (make_socketpair(sv) < 0) exit(EXIT_FAILURE);
+
+    for (uint64_t done = 0; done < iterations; ) {
+        uint64_t batch = iterations - done;
+        if (batch > BENCH_BATCH) batch = BENCH_BATCH;
+
+        for (uint64_t i = 0; i < batch; i++) {
+            const char* line = sample_lines[(done + i) % SAMPLE_LINES];
+            int len = strlen(line);
+            sendall(sv[0], (char*)line, &len, 0);
+        }
+
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < batch; i++) {
+            if (readline(sv[1], buf, MAXLINE) <= 0) {
+                fprintf(stderr, "readline failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        spent += now_ns() - start;
+        done += batch;
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    return spent;
+}
+
+/*
+ * linebuf over a socketpair: the same as bench_readline, but the lines
+ * are read with linebuf_fill()/linebuf_getline(), as the client does
+ */
+static uint64_t bench_linebuf(uint64_t iterations) {
+    int sv[2];
+    char buf[MAXLINE];
+    linebuf_t lb;
+    uint64_t spent = 0;
+
+    if (make_socketpair(sv) < 0) exit(EXIT_FAILURE);
+    linebuf_init(&lb);
+
+    for (uint64_t done = 0; done < iterations; ) {
+        uint64_t batch = iterations - done;
+        if (batch > BENCH_BATCH) batch = BENCH_BATCH;
+
+        for (uint64_t i = 0; i < batch; i++) {
+            const char* line = sample_lines[(done + i) % SAMPLE_LINES];
+            int len = strlen(line);
+            sendall(sv[0], (char*)line, &len, 0);
+        }
+
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < batch; i++) {
+            while (linebuf_getline(&lb, buf, MAXLINE) == 0) {
+                if (linebuf_fill(&lb, sv[1]) <= 0) {
+                    fprintf(stderr, "linebuf_fill failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        spent += now_ns() - start;
+        done += batch;
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    return spent;
+}
+
+/*
+ * sendall over a socketpair: a batch of broadcast frames is sent
+ * (measured) and then drained from the other end (not measured).
+ */
+static uint64_t bench_sendall(uint64_t iterations) {
+    int sv[2];
+    char frame[MAXLINE];
+    char drain[MAXLINE * 4];
+    uint64_t spent = 0;
+
+    if (make_socketpair(sv) < 0) exit(EXIT_FAILURE);
+    int frame_length = formatBroadcast(frame, sizeof(frame), "Melissa", sample_lines[2]);
+
+    for (uint64_t done = 0; done < iterations; ) {
+        uint64_t batch = iterations - done;
+        if (batch > BENCH_BATCH) batch = BENCH_BATCH;
+
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < batch; i++) {
+            int len = frame_length;
+            if (sendall(sv[0], frame, &len, 0) < 0) {
+                fprintf(stderr, "sendall failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        spent += now_ns() - start;
+
+        size_t pending = batch * frame_length;
+        while (pending > 0) {
+            ssize_t n = recv(sv[1], drain, sizeof(drain), 0);
+            if (n <= 0) {
+                fprintf(stderr, "drain failed\n");
+                exit(EXIT_FAILURE);
+            }
+            pending -= n;
+        }
+        done += batch;
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    return spent;
+}
+
+// keeps the compiler from removing the work of the pure benchmarks
+static volatile uint64_t sink = 0;
+
+static uint64_t bench_checkCommand(uint64_t iterations) {
+    char lines[SAMPLE_LINES][MAXLINE];
+    for (size_t i = 0; i < SAMPLE_LINES; i++) strcpy(lines[i], sample_lines[i]);
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        char* line = lines[i % SAMPLE_LINES];
+        sink += checkWHO(line) + checkJOIN(line) + checkLEAVE(line) + checkVERSION(line);
+    }
+    return now_ns() - start;
+}
+
+static uint64_t bench_parseCommand(uint64_t iterations) {
+    char lines[SAMPLE_LINES][MAXLINE];
+    for (size_t i = 0; i < SAMPLE_LINES; i++) strcpy(lines[i], sample_lines[i]);
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += parseCommand(lines[i % SAMPLE_LINES], (i & 1));
+    }
+    return now_ns() - start;
+}
+
+static uint64_t bench_ltrim(uint64_t iterations) {
+    char line[] = "    \t   Hello there, how is everybody doing today?";
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += (uintptr_t)ltrim(line);
+    }
+    return now_ns() - start;
+}
+
+static uint64_t bench_rtrim(uint64_t iterations) {
+    char line[] = "Hello there, how is everybody doing today?    \t   \n";
+    size_t text_length = strlen("Hello there, how is everybody doing today?");
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        rtrim(line);
+        line[text_length] = ' '; // undo the trim for the next round
+        sink += (uintptr_t)line[0];
+    }
+    return now_ns() - start;
+}
+
+static uint64_t bench_formatBroadcast(uint64_t iterations) {
+    char frame[MAXLINE];
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += formatBroadcast(frame, sizeof(frame), "Melissa", sample_lines[i % SAMPLE_LINES]);
+    }
+    return now_ns() - start;
+}
+
+static uint64_t room[BENCH_ROOM];
+
+// stands for the queuing of a frame for every recipient of the range
+static void deliver_range(int first, int last, void* arg) {
+    for (int i = first; i < last; i++) {
+        __atomic_add_fetch(&room[i], (uintptr_t)arg, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * fan-out of broadcasts to a room of BENCH_ROOM recipients, one operation
+ * is the delivery to one recipient. Uses a worker for every core but one.
+ */
+static uint64_t bench_fanout(uint64_t iterations) {
+    uint64_t broadcasts = iterations / BENCH_ROOM + 1;
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < broadcasts; i++) {
+        fanout_run(BENCH_ROOM, BENCH_ROOM, deliver_range, (void*)1);
+    }
+    uint64_t spent = now_ns() - start;
+    sink += room[0];
+
+    // scale to the number of operations asked for
+    return spent * iterations / (broadcasts * BENCH_ROOM);
+}
+
+/*
+ * compression of a broadcast of about 1KB with the chat dictionary, as
+ * done once per class for the clients that asked for it. Costly, so
+ * only one operation of every 16 is timed, and the time scaled. The
+ * allocations of zlib are not seen by the wrappers.
+ */
+static uint64_t bench_zip(uint64_t iterations) {
+    char message[MAXLINE];
+    char record[MAXLINE];
+    size_t len = 0;
+
+    for (int i = 0; len < 1024; i++) {
+        len += formatBroadcast(message + len, sizeof(message) - len, "Melissa",
+                               sample_lines[i % SAMPLE_LINES]);
+    }
+
+    uint64_t compressions = iterations / 16 + 1;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < compressions; i++) {
+        sink += zip_compress(ZIP_CHAT, message, len, record, sizeof(record));
+    }
+    return (now_ns() - start) * iterations / compressions;
+}
+
+typedef struct {
+    const char* name;
+    bench_fn_t fn;
+    bool allocs_unknown;    // made in a library the wrappers do not see
+} bench_t;
+
+static const bench_t benchmarks[] = {
+    { .name = "readline",        .fn = bench_readline },
+    { .name = "linebuf",         .fn = bench_linebuf },
+    { .name = "sendall",         .fn = bench_sendall },
+    { .name = "checkCommand",    .fn = bench_checkCommand },
+    { .name = "parseCommand",    .fn = bench_parseCommand },
+    { .name = "ltrim",           .fn = bench_ltrim },
+    { .name = "rtrim",           .fn = bench_rtrim },
+    { .name = "formatBroadcast", .fn = bench_formatBroadcast },
+    { .name = "fanout",          .fn = bench_fanout },
+    { .name = "zip",             .fn = bench_zip, .allocs_unknown = true },
+};
+#define BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static bench_result_t run_benchmark(const bench_t* bench, uint64_t iterations) {
+    uint64_t spent[BENCH_REPEAT];
+    uint64_t allocs = 0, bytes = 0;
+
+    bench->fn(iterations / 10 + 1); // warm up
+
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        uint64_t count_before = alloc_count, bytes_before = alloc_bytes;
+        spent[r] = bench->fn(iterations);
+        allocs += alloc_count - count_before;
+        bytes += alloc_bytes - bytes_before;
+    }
+    qsort(spent, BENCH_REPEAT, sizeof(spent[0]), compare_u64);
+
+    bench_result_t result;
+    result.name = bench->name;
+    result.iterations = iterations;
+    result.ns_per_op = (double)spent[BENCH_REPEAT / 2] / (double)iterations;
+    result.allocs_per_op = (double)allocs / (double)(iterations * BENCH_REPEAT);
+    result.alloc_bytes_per_op = (double)bytes / (double)(iterations * BENCH_REPEAT);
+    result.allocs_unknown = bench->allocs_unknown;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    uint64_t iterations = BENCH_DEFAULT_ITERATIONS;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 2) {
+        char* end = NULL;
+        errno = 0;
+        iterations = strtoull(argv[1], &end, 10);
+        if (errno != 0 || *end != '\0' || iterations == 0) {
+            fprintf(stderr, "invalid number of iterations: %s\n", argv[1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    fanout_config.workers = (cores > 1) ? cores - 1 : 0;
+    fanout_config.threshold = 0;
+    if (fanout_init() < 0) {
+        fprintf(stderr, "failed to start the fan-out workers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < BENCHMARKS; i++) {
+        bench_result_t r = run_benchmark(&benchmarks[i], iterations);
+        printf("    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, ",
+               r.name, (unsigned long long)r.iterations, r.ns_per_op);
+        if (r.allocs_unknown) {
+            printf("\"allocs_per_op\": null, \"alloc_bytes_per_op\": null}");
+        } else {
+            printf("\"allocs_per_op\": %.4f, \"alloc_bytes_per_op\": %.2f}",
+                   r.allocs_per_op, r.alloc_bytes_per_op);
+        }
+        printf("%s\n", (i + 1 < BENCHMARKS) ? "," : "");
+        fflush(stdout);
+    }
+    printf("  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
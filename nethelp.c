@@ -92,7 +92,8 @@ int open_clientfd(char *hostname, int port)
 
     // fill in the server's IP address and port
     if ((hp = gethostbyname(hostname)) == NULL) { 
-	fprintf(stderr, "unknown host name %s\n", hp->h_name);
+	fprintf(stderr, "unknown host name %s\n", hostname);
+        close(clientfd);
         return -2;
     }
     fprintf(stdout, "connecting to host name %s\n", hp->h_name);
@@ -107,6 +108,7 @@ int open_clientfd(char *hostname, int port)
     if (connect(clientfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0)
     {    printf("Error connecting with the server\n");
          reportErrno();
+         close(clientfd);
 	 return -1;
     }
 
@@ -114,6 +116,70 @@ int open_clientfd(char *hostname, int port)
 }
 
 
+static int fill_unix_address(struct sockaddr_un* address, const char* path)
+{
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "unix socket path too long: %s\n", path);
+        return -1;
+    }
+    bzero((char*)address, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/*
+ * open_unix_listenfd - open and return a listening unix domain socket on path
+ * return -1 in case of failure
+ */
+int open_unix_listenfd(const char* path)
+{
+    int listenfd;
+    struct sockaddr_un serveraddr;
+
+    if (fill_unix_address(&serveraddr, path) < 0)
+    { return -1; }
+
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    { return -1; }
+
+    // the file of the socket is left behind when the server ends
+    unlink(path);
+    if ((bind(listenfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0)
+        || (listen(listenfd, LISTENQ) < 0)) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * open_unix_clientfd - open connection to the server on the unix
+ * domain socket path. return -1 in case of failure
+ */
+int open_unix_clientfd(const char* path)
+{
+    int clientfd;
+    struct sockaddr_un serveraddr;
+
+    if (fill_unix_address(&serveraddr, path) < 0)
+    { return -1; }
+
+    errno = 0;
+    if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "socket creation failed\n");
+        reportErrno();
+        return -1;
+    }
+    if (connect(clientfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0) {
+        printf("Error connecting with the server\n");
+        reportErrno();
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
 /*
  * readline -read a line of text ending with '\0'
  * return the number of characters read;
@@ -159,3 +225,63 @@ int sendall(int s, char *buff, int *len, int flags)
     return ((n == -1) ? -1 : 0);  // return -1 on failure, 0 on success.
 }
 
+
+void linebuf_init(linebuf_t* lb)
+{
+    lb->start = 0;
+    lb->end = 0;
+}
+
+ssize_t linebuf_fill(linebuf_t* lb, int fd)
+{
+    // move the partial line to the front to make room
+    if (lb->start > 0) {
+        memmove(lb->data, lb->data + lb->start, lb->end - lb->start);
+        lb->end -= lb->start;
+        lb->start = 0;
+    }
+    if (lb->end == sizeof(lb->data)) { return 1; } // full, the caller must consume first
+
+    ssize_t n = read(fd, lb->data + lb->end, sizeof(lb->data) - lb->end);
+    if (n > 0) { lb->end += n; }
+    return n;
+}
+
+size_t linebuf_append(linebuf_t* lb, const char* data, size_t len)
+{
+    if (lb->start > 0) {
+        memmove(lb->data, lb->data + lb->start, lb->end - lb->start);
+        lb->end -= lb->start;
+        lb->start = 0;
+    }
+    size_t room = sizeof(lb->data) - lb->end;
+    if (len > room) { len = room; }
+    memcpy(lb->data + lb->end, data, len);
+    lb->end += len;
+    return len;
+}
+
+int linebuf_getline(linebuf_t* lb, char* line, int maxlen)
+{
+    size_t available = lb->end - lb->start;
+    if (available == 0 || maxlen < 2) return 0;
+
+    char* begin = lb->data + lb->start;
+    char* newline = memchr(begin, '\n', available);
+    size_t length;
+
+    if (newline != NULL) {
+        length = newline - begin + 1;
+    } else if (lb->start == 0 && lb->end == sizeof(lb->data)) {
+        length = available; // a line longer than the buffer, return a piece
+    } else {
+        return 0;           // wait for the rest of the line
+    }
+
+    if (length > (size_t)(maxlen - 1)) { length = maxlen - 1; }
+    memcpy(line, begin, length);
+    line[length] = '\0';
+    lb->start += length;
+    if (lb->start == lb->end) { lb->start = lb->end = 0; }
+    return (int)length;
+}
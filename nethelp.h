@@ -10,6 +10,7 @@
 #include <strings.h>      // for bzero, bcopy
 #include <unistd.h>       // for read, write
 #include <sys/socket.h>   // for using sockets
+#include <sys/un.h>       // for unix domain sockets
 #include <netdb.h> 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -36,6 +37,20 @@ char* rtrim(char* str); // trim string of spaces from the right
  */
  int open_clientfd(char* hostname, int port);
 
+/*
+ *  open_unix_listenfd - open and return a listening unix domain
+ *  socket on path, replacing any old socket file on it
+ *  return -1 in case of failure
+ */
+ int open_unix_listenfd(const char* path);
+
+/*
+ * open_unix_clientfd - open connection to the server listening on
+ * the unix domain socket path
+ * return -1 in case of failure
+ */
+ int open_unix_clientfd(const char* path);
+
 /*
  * readline - read a line of text ending with '\0'
  * return the number of charcters read
@@ -51,4 +66,38 @@ char* rtrim(char* str); // trim string of spaces from the right
  */
 int sendall(int s, char *buff, int *len, int flags);
 
+/*
+ * linebuf - buffered reader of lines, the successor of readline()
+ * for event loops: linebuf_fill() does a single read() of whatever is
+ * available, and linebuf_getline() returns the complete lines, so a
+ * message split across several reads is reassembled.
+ */
+typedef struct {
+    char data[MAXLINE];
+    size_t start;   // first byte not consumed yet
+    size_t end;     // end of the valid data
+} linebuf_t;
+
+void linebuf_init(linebuf_t* lb);
+
+/*
+ * linebuf_fill - read once from fd into the buffer
+ * return the value returned by read(): 0 on EOF, -1 in case of failure
+ */
+ssize_t linebuf_fill(linebuf_t* lb, int fd);
+
+/*
+ * linebuf_append - copy into the buffer data already received (for
+ * event loops that read by themselves), as much as fits
+ * return the number of bytes copied, 0 if the buffer is full
+ */
+size_t linebuf_append(linebuf_t* lb, const char* data, size_t len);
+
+/*
+ * linebuf_getline - copy the next complete line (with its '\n') into
+ * line, ending with '\0'. A line longer than the buffer is returned in
+ * pieces. return the length of the line, 0 if there is no complete line
+ */
+int linebuf_getline(linebuf_t* lb, char* line, int maxlen);
+
 #endif //__NET_HELP